@@ -3,74 +3,466 @@
 // All rights reserved. License: 2-clause BSD
 
 #include "audio.h"
+#include "glue.h"
+#include "golden.h"
 #include "vera_psg.h"
 #include "vera_pcm.h"
 #include "ym2151.h"
+#include "resample.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <math.h>
 
 #define SAMPLERATE (25000000 / 512)
 
-#ifdef __EMSCRIPTEN__
-	#define SAMPLES_PER_BUFFER (1024)
-#else
-	#define SAMPLES_PER_BUFFER (256)
-#endif
+#define SAMPLES_PER_BUFFER AUDIO_SAMPLES_PER_BUFFER
+
+// register writes that can be waiting for the synthesis thread
+#define AUDIO_QUEUE_SIZE 16384
+// blocks of PCM output the synthesis thread may lag behind
+#define AUDIO_BLOCKS 8
+
+#define MAX_SINKS 3
 
 static SDL_AudioDeviceID audio_dev;
 static int               vera_clks = 0;
 static int               cpu_clks  = 0;
-static int16_t **        buffers;
-static int               rdidx    = 0;
-static int               wridx    = 0;
-static int               buf_cnt  = 0;
-static int               num_bufs = 0;
+
+// Audio sinks: every mixed block goes to all open sinks. Without any, and
+// with the meters off, register writes are applied but nothing is
+// synthesized; the PCM FIFO still drains in time, since the CPU sees its
+// fill level.
+struct audio_block {
+	const int16_t *psg;
+	const int16_t *pcm;
+	const int16_t *ym;
+	const int16_t *mix;
+};
+
+struct audio_sink {
+	void (*write)(const struct audio_block *block);
+	void (*close)(void);
+};
+
+static const struct audio_sink *sinks[MAX_SINKS];
+static int               num_sinks;
+
+// Mixer: every source is scaled by its gain, in 1/256, and the sum is
+// saturated. The meters are published to other threads once per block.
+static int32_t           gains[3] = { 85, 85, 85 }; // about 1/3 each
+static SDL_atomic_t      meters_enabled;
+static SDL_atomic_t      meter_peak[AUDIO_SOURCES][2];
+static SDL_atomic_t      meter_rms[AUDIO_SOURCES][2];
+static double            meter_mean_square[AUDIO_SOURCES][2]; // synthesis thread only
+
+static SDL_RWops *       out_file;
+static bool              out_wav;
+static bool              out_split;
+static uint32_t          out_frames;
+
+// Synthesis thread: the PSG and the YM2151 are write-only for the CPU, so
+// they are rendered on their own thread. Register writes are queued with
+// the sample they happen at, and the thread renders up to that sample
+// before applying them. A block marker ends every block of
+// SAMPLES_PER_BUFFER samples; the PCM output, which depends on the FIFO
+// the CPU sees, is still rendered on the emulation thread and handed over
+// with it. Without the thread, the emulation thread processes the queue
+// itself at the end of every block.
+enum audio_command {
+	AUDIO_CMD_PSG_WRITE,
+	AUDIO_CMD_PSG_RESET,
+	AUDIO_CMD_YM_WRITE,
+	AUDIO_CMD_BLOCK,
+	AUDIO_CMD_QUIT,
+};
+
+static SDL_Thread *      synth_thread;
+static uint32_t          audio_queue[AUDIO_QUEUE_SIZE];
+static uint32_t          audio_queue_wridx;        // emulation thread only
+static uint32_t          audio_queue_rdidx_cached; // emulation thread only
+static SDL_atomic_t      audio_queue_published_wridx;
+static SDL_atomic_t      audio_queue_rdidx;
+static SDL_sem *         audio_queue_sem;
+static int16_t           pcm_blocks[AUDIO_BLOCKS][2 * SAMPLES_PER_BUFFER];
+static uint32_t          blocks_queued;            // emulation thread only
+static SDL_atomic_t      blocks_done;
+
+// The PCM FIFO is only brought up to date when the next sample reading
+// from it is due, or when the CPU accesses the PCM registers. Both are
+// counted in samples of the current block.
+static unsigned          pcm_pos;                  // emulation thread only
+static unsigned          pcm_event;                // emulation thread only
+
+// synthesis thread only
+static uint32_t          synth_rdidx;
+static unsigned          synth_pos;
+static int16_t           synth_psg[2 * SAMPLES_PER_BUFFER];
+static int16_t           synth_ym[2 * SAMPLES_PER_BUFFER];
+
+// Lock-free single-producer/single-consumer ring of stereo samples between
+// the synthesis thread and the audio callback. The indices count samples
+// and only ever grow; the ring size is a power of two, so they can wrap.
+static int16_t *         ring;
+static int16_t *         resample_buf;      // synthesis thread only
+static uint32_t          ring_size;
+static uint32_t          ring_wridx;        // synthesis thread only
+static uint32_t          ring_rdidx_cached; // synthesis thread only
+static SDL_atomic_t      ring_published_wridx;
+static SDL_atomic_t      ring_rdidx;
+
+// fill level statistics, see audio_get_stats()
+static uint32_t          stats_fill_min;
+static uint32_t          stats_fill_max;
+static uint64_t          stats_fill_sum;
+static uint32_t          stats_fill_count;
+static uint32_t          stats_dropped;
+static SDL_atomic_t      stats_underruns;
 
 static void
 audio_callback(void *userdata, Uint8 *stream, int len)
 {
-	int expected = 2 * SAMPLES_PER_BUFFER * sizeof(int16_t);
-	if (len != expected) {
-		printf("Audio buffer size mismatch! (expected: %d, got: %d)\n", expected, len);
+	int16_t *out = (int16_t *)stream;
+	const uint32_t wanted = len / (2 * sizeof(int16_t));
+	const uint32_t rdidx = SDL_AtomicGet(&ring_rdidx);
+	const uint32_t available = (uint32_t)SDL_AtomicGet(&ring_published_wridx) - rdidx;
+	const uint32_t count = available < wanted ? available : wanted;
+
+	const uint32_t pos = rdidx & (ring_size - 1);
+	const uint32_t first = count < ring_size - pos ? count : ring_size - pos;
+	memcpy(out, &ring[pos * 2], first * 2 * sizeof(int16_t));
+	memcpy(out + first * 2, ring, (count - first) * 2 * sizeof(int16_t));
+	SDL_AtomicSet(&ring_rdidx, rdidx + count);
+
+	if (count < wanted) {
+		// the emulation fell behind, fill up with silence
+		memset(out + count * 2, 0, (wanted - count) * 2 * sizeof(int16_t));
+		SDL_AtomicIncRef(&stats_underruns);
+	}
+}
+
+// Queue samples for playback. This never waits for the audio thread:
+// whatever doesn't fit into the ring is dropped and counted.
+static void
+ring_push(const int16_t *samples, uint32_t count)
+{
+	uint32_t fill = ring_wridx - ring_rdidx_cached;
+	if (ring_size - fill < count) {
+		ring_rdidx_cached = SDL_AtomicGet(&ring_rdidx);
+		fill = ring_wridx - ring_rdidx_cached;
+	}
+
+	if (fill < stats_fill_min) {
+		stats_fill_min = fill;
+	}
+	if (fill > stats_fill_max) {
+		stats_fill_max = fill;
+	}
+	stats_fill_sum += fill;
+	stats_fill_count++;
+
+	if (count > ring_size - fill) {
+		stats_dropped += count - (ring_size - fill);
+		count = ring_size - fill;
+	}
+
+	const uint32_t pos = ring_wridx & (ring_size - 1);
+	const uint32_t first = count < ring_size - pos ? count : ring_size - pos;
+	memcpy(&ring[pos * 2], samples, first * 2 * sizeof(int16_t));
+	memcpy(ring, samples + first * 2, (count - first) * 2 * sizeof(int16_t));
+	ring_wridx += count;
+	SDL_AtomicSet(&ring_published_wridx, ring_wridx);
+}
+
+// RIFF/WAVE header for 16 bit samples
+static void
+wav_write_header(SDL_RWops *f, uint16_t channels, uint32_t frames)
+{
+	const uint32_t data_size = frames * channels * sizeof(int16_t);
+	SDL_RWwrite(f, "RIFF", 1, 4);
+	SDL_WriteLE32(f, 36 + data_size);
+	SDL_RWwrite(f, "WAVEfmt ", 1, 8);
+	SDL_WriteLE32(f, 16);
+	SDL_WriteLE16(f, 1); // PCM
+	SDL_WriteLE16(f, channels);
+	SDL_WriteLE32(f, SAMPLERATE);
+	SDL_WriteLE32(f, SAMPLERATE * channels * sizeof(int16_t));
+	SDL_WriteLE16(f, channels * sizeof(int16_t));
+	SDL_WriteLE16(f, 16);
+	SDL_RWwrite(f, "data", 1, 4);
+	SDL_WriteLE32(f, data_size);
+}
+
+// Whether the output is used at all
+static bool
+synth_needed()
+{
+	return num_sinks > 0 || SDL_AtomicGet(&meters_enabled);
+}
+
+// Render PSG and YM2151 output up to the given sample of the block.
+static void
+synth_render(unsigned time)
+{
+	if (time <= synth_pos) {
 		return;
 	}
+	if (synth_needed()) {
+		psg_render(&synth_psg[synth_pos * 2], time - synth_pos);
+		YM_stream_update((uint16_t *)&synth_ym[synth_pos * 2], time - synth_pos);
+	}
+	synth_pos = time;
+}
 
-	if (buf_cnt == 0) {
-		memset(stream, 0, len);
+// Playback on the audio device, resampled to its rate
+static void
+device_write(const struct audio_block *block)
+{
+	// Keep the ring half full: play a little faster when it fills up,
+	// and a little slower when it runs low.
+	const uint32_t fill = ring_wridx - (uint32_t)SDL_AtomicGet(&ring_rdidx);
+	resample_set_adjust(((double)fill - ring_size / 2) / (ring_size / 2));
+	ring_push(resample_buf, resample_process(block->mix, SAMPLES_PER_BUFFER, resample_buf));
+}
+
+static void
+device_close()
+{
+	SDL_CloseAudioDevice(audio_dev);
+	audio_dev = 0;
+}
+
+static const struct audio_sink device_sink = { device_write, device_close };
+
+// Capture into a WAV or raw file: the mixed stereo output, or with
+// out_split, the stereo output of the PSG, PCM and YM2151 side by side in
+// 6 channels. The samples follow emulated time, just like the frames of
+// a video capture.
+static void
+file_write(const struct audio_block *block)
+{
+	for (int i = 0; i < 2 * SAMPLES_PER_BUFFER; i += 2) {
+		if (out_split) {
+			SDL_WriteLE16(out_file, block->psg[i]);
+			SDL_WriteLE16(out_file, block->psg[i + 1]);
+			SDL_WriteLE16(out_file, block->pcm[i]);
+			SDL_WriteLE16(out_file, block->pcm[i + 1]);
+			SDL_WriteLE16(out_file, block->ym[i]);
+			SDL_WriteLE16(out_file, block->ym[i + 1]);
+		} else {
+			SDL_WriteLE16(out_file, block->mix[i]);
+			SDL_WriteLE16(out_file, block->mix[i + 1]);
+		}
+	}
+	out_frames += SAMPLES_PER_BUFFER;
+}
+
+static void
+file_close()
+{
+	if (out_wav) {
+		// now that the length is known, fix up the header
+		SDL_RWseek(out_file, 0, RW_SEEK_SET);
+		wav_write_header(out_file, out_split ? 6 : 2, out_frames);
+	}
+	SDL_RWclose(out_file);
+	out_file = NULL;
+}
+
+static const struct audio_sink file_sink = { file_write, file_close };
+
+// Hashes for regression runs
+static void
+hash_write(const struct audio_block *block)
+{
+	golden_audio(block->mix, 2 * SAMPLES_PER_BUFFER);
+}
+
+static const struct audio_sink hash_sink = { hash_write, NULL };
+
+// Peak and RMS levels of one source in the block. The peak falls back
+// slowly, and the RMS is averaged over about 8 blocks, or 40 ms.
+static void
+meter_block(int source, const int16_t *buf)
+{
+	for (int c = 0; c < 2; c++) {
+		int32_t peak = 0;
+		int64_t sum  = 0;
+		for (int i = c; i < 2 * SAMPLES_PER_BUFFER; i += 2) {
+			const int32_t v = buf[i] < 0 ? -buf[i] : buf[i];
+			peak = v > peak ? v : peak;
+			sum += v * v;
+		}
+		const int32_t old_peak = SDL_AtomicGet(&meter_peak[source][c]);
+		const int32_t falling  = old_peak - old_peak / 16;
+		SDL_AtomicSet(&meter_peak[source][c], peak > falling ? peak : falling);
+
+		double *mean_square = &meter_mean_square[source][c];
+		*mean_square += ((double)sum / SAMPLES_PER_BUFFER - *mean_square) / 8;
+		SDL_AtomicSet(&meter_rms[source][c], (int)sqrt(*mean_square));
+	}
+}
+
+static void
+synth_mix(const int16_t *pcm_buf)
+{
+	if (!synth_needed()) {
 		return;
 	}
 
-	memcpy(stream, buffers[rdidx++], len);
-	if (rdidx == num_bufs) {
-		rdidx = 0;
+	// Mix PSG, PCM and YM output
+	const int32_t gain_psg = gains[AUDIO_SOURCE_PSG];
+	const int32_t gain_pcm = gains[AUDIO_SOURCE_PCM];
+	const int32_t gain_ym  = gains[AUDIO_SOURCE_YM];
+	int16_t mix_buf[2 * SAMPLES_PER_BUFFER];
+	for (int i = 0; i < 2 * SAMPLES_PER_BUFFER; i++) {
+		int32_t v = (synth_psg[i] * gain_psg + pcm_buf[i] * gain_pcm + synth_ym[i] * gain_ym) >> 8;
+		v = v > 32767 ? 32767 : v;
+		v = v < -32768 ? -32768 : v;
+		mix_buf[i] = v;
+	}
+
+	if (SDL_AtomicGet(&meters_enabled)) {
+		meter_block(AUDIO_SOURCE_PSG, synth_psg);
+		meter_block(AUDIO_SOURCE_PCM, pcm_buf);
+		meter_block(AUDIO_SOURCE_YM, synth_ym);
+		meter_block(AUDIO_SOURCE_MIX, mix_buf);
+	}
+
+	const struct audio_block block = { synth_psg, pcm_buf, synth_ym, mix_buf };
+	for (int i = 0; i < num_sinks; i++) {
+		sinks[i]->write(&block);
+	}
+}
+
+// Apply the queued register writes, rendering the samples in between.
+// Returns false when asked to quit.
+static bool
+synth_process()
+{
+	const uint32_t wridx = SDL_AtomicGet(&audio_queue_published_wridx);
+	while (synth_rdidx != wridx) {
+		const uint32_t command = audio_queue[synth_rdidx++ & (AUDIO_QUEUE_SIZE - 1)];
+		const uint8_t reg = (command >> 8) & 0xff;
+		const uint8_t value = command & 0xff;
+		switch (command >> 28) {
+			case AUDIO_CMD_PSG_WRITE:
+				synth_render((command >> 16) & 0xfff);
+				psg_writereg(reg, value);
+				break;
+			case AUDIO_CMD_PSG_RESET:
+				synth_render((command >> 16) & 0xfff);
+				psg_reset();
+				break;
+			case AUDIO_CMD_YM_WRITE:
+				synth_render((command >> 16) & 0xfff);
+				YM_write_reg(reg, value);
+				break;
+			case AUDIO_CMD_BLOCK:
+				synth_render(SAMPLES_PER_BUFFER);
+				synth_mix(pcm_blocks[(uint32_t)SDL_AtomicGet(&blocks_done) % AUDIO_BLOCKS]);
+				synth_pos = 0;
+				SDL_AtomicIncRef(&blocks_done);
+				break;
+			case AUDIO_CMD_QUIT:
+				SDL_AtomicSet(&audio_queue_rdidx, synth_rdidx);
+				return false;
+		}
+	}
+	SDL_AtomicSet(&audio_queue_rdidx, synth_rdidx);
+	return true;
+}
+
+static int
+synth_thread_main(void *data)
+{
+	do {
+		SDL_SemWait(audio_queue_sem);
+	} while (synth_process());
+	return 0;
+}
+
+static void
+audio_queue_publish()
+{
+	SDL_AtomicSet(&audio_queue_published_wridx, audio_queue_wridx);
+	if (synth_thread) {
+		SDL_SemPost(audio_queue_sem);
+	} else {
+		synth_process();
 	}
-	buf_cnt--;
+}
+
+static void
+audio_queue_push(uint8_t command, uint8_t reg, uint8_t value)
+{
+	while (audio_queue_wridx - audio_queue_rdidx_cached >= AUDIO_QUEUE_SIZE) {
+		audio_queue_rdidx_cached = SDL_AtomicGet(&audio_queue_rdidx);
+		if (audio_queue_wridx - audio_queue_rdidx_cached >= AUDIO_QUEUE_SIZE) {
+			// full, let the synthesis catch up
+			audio_queue_publish();
+			if (synth_thread) {
+				SDL_Delay(1);
+			}
+		}
+	}
+	// the sample in the current block the write happens at
+	const uint32_t time = vera_clks / 512;
+	audio_queue[audio_queue_wridx++ & (AUDIO_QUEUE_SIZE - 1)] = command << 28 | time << 16 | reg << 8 | value;
+}
+
+void
+audio_write_psg(uint8_t reg, uint8_t value)
+{
+	audio_queue_push(AUDIO_CMD_PSG_WRITE, reg, value);
+}
+
+void
+audio_reset_psg()
+{
+	audio_queue_push(AUDIO_CMD_PSG_RESET, 0, 0);
 }
 
 void
-audio_init(const char *dev_name, int num_audio_buffers)
+audio_write_ym(uint8_t reg, uint8_t value)
+{
+	audio_queue_push(AUDIO_CMD_YM_WRITE, reg, value);
+}
+
+void
+audio_init(const char *dev_name, int ring_samples, const char *out_path, bool split)
 {
 	if (audio_dev > 0) {
 		audio_close();
 	}
 
-	// Set number of buffers
-	num_bufs = num_audio_buffers;
-	if (num_bufs < 3) {
-		num_bufs = 3;
+	// Set the ring size, rounded up to a power of two
+	if (ring_samples < 3 * SAMPLES_PER_BUFFER) {
+		ring_samples = 3 * SAMPLES_PER_BUFFER;
 	}
-	if (num_bufs > 1024) {
-		num_bufs = 1024;
+	if (ring_samples > 1024 * SAMPLES_PER_BUFFER) {
+		ring_samples = 1024 * SAMPLES_PER_BUFFER;
 	}
-
-	// Allocate audio buffers
-	buffers = malloc(num_bufs * sizeof(*buffers));
-	for (int i = 0; i < num_bufs; i++) {
-		buffers[i] = malloc(2 * SAMPLES_PER_BUFFER * sizeof(buffers[0][0]));
+	ring_size = 1;
+	while (ring_size < ring_samples) {
+		ring_size <<= 1;
 	}
 
+	// Allocate the ring
+	ring = malloc(ring_size * 2 * sizeof(ring[0]));
+	ring_wridx = 0;
+	ring_rdidx_cached = 0;
+	SDL_AtomicSet(&ring_published_wridx, 0);
+	SDL_AtomicSet(&ring_rdidx, 0);
+
+	stats_fill_min = ring_size;
+	stats_fill_max = 0;
+	stats_fill_sum = 0;
+	stats_fill_count = 0;
+	stats_dropped = 0;
+	SDL_AtomicSet(&stats_underruns, 0);
+
 	SDL_AudioSpec desired;
 	SDL_AudioSpec obtained;
 
@@ -82,40 +474,159 @@ audio_init(const char *dev_name, int num_audio_buffers)
 	desired.channels = 2;
 	desired.callback = audio_callback;
 
-	audio_dev = SDL_OpenAudioDevice(dev_name, 0, &desired, &obtained, 0);
-	if (audio_dev <= 0) {
-		fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
-		if (dev_name != NULL) {
-			audio_usage();
+	num_sinks = 0;
+	obtained  = desired;
+
+	if (headless) {
+		// only mix, for the regression hashes
+		sinks[num_sinks++] = &hash_sink;
+	} else if (dev_name == NULL || strcmp(dev_name, "none")) {
+		// let the device pick its own rate, we resample to it
+		audio_dev = SDL_OpenAudioDevice(dev_name, 0, &desired, &obtained, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE);
+		if (audio_dev <= 0) {
+			fprintf(stderr, "SDL_OpenAudioDevice failed: %s\n", SDL_GetError());
+			if (dev_name != NULL) {
+				audio_usage();
+			}
+			// keep running without sound
+			audio_dev = 0;
+			obtained  = desired;
+		} else {
+			sinks[num_sinks++] = &device_sink;
+		}
+	}
+
+	if (out_path) {
+		out_file = SDL_RWFromFile(out_path, "wb");
+		if (!out_file) {
+			fprintf(stderr, "Cannot open %s for audio capture.\n", out_path);
+			exit(1);
+		}
+		const size_t len = strlen(out_path);
+		out_wav    = len >= 4 && (!strcmp(out_path + len - 4, ".wav") || !strcmp(out_path + len - 4, ".WAV"));
+		out_split  = split;
+		out_frames = 0;
+		if (out_wav) {
+			wav_write_header(out_file, out_split ? 6 : 2, 0);
 		}
-		exit(-1);
+		sinks[num_sinks++] = &file_sink;
 	}
 
-	// Init YM2151 emulation. 4 MHz clock
+	// Init YM2151 emulation. 4 MHz clock; the tables for this clock and
+	// rate are precomputed, see YM_TABLES_* in the Makefile
 	YM_Create(4000000);
-	YM_init(obtained.freq, 60);
+	YM_init(SAMPLERATE, 60);
+
+	resample_init(SAMPLERATE, obtained.freq);
+	resample_buf = malloc(resample_max_output(SAMPLES_PER_BUFFER) * 2 * sizeof(resample_buf[0]));
+
+	// Regression runs need the audio of every frame before the frame ends,
+	// so they always synthesize on the emulation thread.
+	if (!headless) {
+		audio_queue_sem = SDL_CreateSemaphore(0);
+		synth_thread = SDL_CreateThread(synth_thread_main, "x16emu audio", NULL);
+		if (!synth_thread) {
+			// synthesize on the emulation thread then
+			SDL_DestroySemaphore(audio_queue_sem);
+			audio_queue_sem = NULL;
+		}
+	}
 
 	// Start playback
-	SDL_PauseAudioDevice(audio_dev, 0);
+	if (audio_dev != 0) {
+		SDL_PauseAudioDevice(audio_dev, 0);
+	}
 }
 
 void
 audio_close(void)
 {
-	SDL_CloseAudioDevice(audio_dev);
-	audio_dev = 0;
+	if (synth_thread) {
+		audio_queue_push(AUDIO_CMD_QUIT, 0, 0);
+		audio_queue_publish();
+		SDL_WaitThread(synth_thread, NULL);
+		synth_thread = NULL;
+		SDL_DestroySemaphore(audio_queue_sem);
+		audio_queue_sem = NULL;
+	}
 
-	// Free audio buffers
-	if (buffers != NULL) {
-		for (int i = 0; i < num_bufs; i++) {
-			if (buffers[i] != NULL) {
-				free(buffers[i]);
-				buffers[i] = NULL;
-			}
+	for (int i = 0; i < num_sinks; i++) {
+		if (sinks[i]->close) {
+			sinks[i]->close();
 		}
-		free(buffers);
-		buffers = NULL;
 	}
+	num_sinks = 0;
+
+	// Free the ring
+	free(ring);
+	ring = NULL;
+	free(resample_buf);
+	resample_buf = NULL;
+}
+
+// Set the gain of a source in percent; 100 passes it through unchanged.
+void
+audio_set_gain(enum audio_source source, int percent)
+{
+	if (source < AUDIO_SOURCE_MIX) {
+		gains[source] = (percent * 256 + 50) / 100;
+	}
+}
+
+void
+audio_enable_meters(bool enable)
+{
+	SDL_AtomicSet(&meters_enabled, enable);
+}
+
+bool
+audio_meters_enabled()
+{
+	return SDL_AtomicGet(&meters_enabled);
+}
+
+void
+audio_get_meter(enum audio_source source, struct audio_meter *meter)
+{
+	for (int c = 0; c < 2; c++) {
+		meter->peak[c] = SDL_AtomicGet(&meter_peak[source][c]);
+		meter->rms[c]  = SDL_AtomicGet(&meter_rms[source][c]);
+	}
+}
+
+// Call after audio_close(): the synthesis thread updates the statistics
+// without synchronization.
+void
+audio_get_stats(struct audio_stats *stats)
+{
+	stats->size = ring_size;
+	stats->fill = (uint32_t)SDL_AtomicGet(&ring_published_wridx) - (uint32_t)SDL_AtomicGet(&ring_rdidx);
+	stats->fill_min = stats_fill_count ? stats_fill_min : 0;
+	stats->fill_max = stats_fill_max;
+	stats->fill_avg = stats_fill_count ? (uint32_t)(stats_fill_sum / stats_fill_count) : 0;
+	stats->dropped = stats_dropped;
+	stats->underruns = SDL_AtomicGet(&stats_underruns);
+}
+
+// Advance the PCM output to the given sample of the current block.
+static void
+pcm_advance(unsigned time)
+{
+	if (time > pcm_pos) {
+		int16_t *buf = synth_needed() ? &pcm_blocks[blocks_queued % AUDIO_BLOCKS][pcm_pos * 2] : NULL;
+		pcm_render(buf, time - pcm_pos);
+		pcm_pos = time;
+	}
+}
+
+// Bring the PCM FIFO up to date before the CPU accesses it. The next
+// audio_render() schedules the following read again, in case the access
+// changes the rate or the format.
+void
+audio_sync_pcm()
+{
+	pcm_advance(vera_clks / 512);
+	pcm_event = pcm_pos;
 }
 
 void
@@ -129,39 +640,27 @@ audio_render(int cpu_clocks)
 	}
 
 	while (vera_clks >= 512 * SAMPLES_PER_BUFFER) {
+		pcm_advance(SAMPLES_PER_BUFFER);
 		vera_clks -= 512 * SAMPLES_PER_BUFFER;
+		blocks_queued++;
 
-		if (audio_dev != 0) {
-			int16_t psg_buf[2 * SAMPLES_PER_BUFFER];
-			psg_render(psg_buf, SAMPLES_PER_BUFFER);
-
-			int16_t pcm_buf[2 * SAMPLES_PER_BUFFER];
-			pcm_render(pcm_buf, SAMPLES_PER_BUFFER);
-
-			int16_t ym_buf[2 * SAMPLES_PER_BUFFER];
-			YM_stream_update((uint16_t *)ym_buf, SAMPLES_PER_BUFFER);
-
-			bool buf_available;
-			SDL_LockAudioDevice(audio_dev);
-			buf_available = buf_cnt < num_bufs;
-			SDL_UnlockAudioDevice(audio_dev);
-
-			if (buf_available) {
-				// Mix PSG, PCM and YM output
-				int16_t *buf = buffers[wridx];
-				for (int i = 0; i < 2 * SAMPLES_PER_BUFFER; i++) {
-					buf[i] = ((int)psg_buf[i] + (int)pcm_buf[i] + (int)ym_buf[i]) / 3;
-				}
-
-				SDL_LockAudioDevice(audio_dev);
-				wridx++;
-				if (wridx == num_bufs) {
-					wridx = 0;
-				}
-				buf_cnt++;
-				SDL_UnlockAudioDevice(audio_dev);
-			}
+		audio_queue_push(AUDIO_CMD_BLOCK, 0, 0);
+		audio_queue_publish();
+
+		// wait for the synthesis thread to free up the next PCM block
+		while (blocks_queued - (uint32_t)SDL_AtomicGet(&blocks_done) >= AUDIO_BLOCKS) {
+			SDL_Delay(1);
 		}
+		pcm_pos   = 0;
+		pcm_event = 0;
+	}
+
+	// the next sample that reads from the FIFO is due
+	const unsigned now = vera_clks / 512;
+	if (now >= pcm_event) {
+		pcm_advance(now);
+		const unsigned until_read = pcm_samples_until_read();
+		pcm_event = until_read ? pcm_pos + until_read : SAMPLES_PER_BUFFER;
 	}
 }
 
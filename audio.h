@@ -5,9 +5,53 @@
 #pragma once
 
 #include <SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
 
-void audio_init(const char *dev_name, int num_audio_buffers);
+#ifdef __EMSCRIPTEN__
+	#define AUDIO_SAMPLES_PER_BUFFER (1024)
+#else
+	#define AUDIO_SAMPLES_PER_BUFFER (256)
+#endif
+
+// fill levels of the playback ring, in stereo samples
+struct audio_stats {
+	uint32_t size;
+	uint32_t fill;
+	uint32_t fill_min;
+	uint32_t fill_avg;
+	uint32_t fill_max;
+	uint32_t dropped;   // samples that didn't fit into the ring
+	uint32_t underruns; // callbacks that found too few samples
+};
+
+enum audio_source {
+	AUDIO_SOURCE_PSG,
+	AUDIO_SOURCE_PCM,
+	AUDIO_SOURCE_YM,
+	AUDIO_SOURCE_MIX,
+	AUDIO_SOURCES,
+};
+
+// absolute sample levels of the left and right channel, 0 to 32768
+struct audio_meter {
+	uint16_t peak[2];
+	uint16_t rms[2];
+};
+
+void audio_init(const char *dev_name, int ring_samples, const char *out_path, bool split);
 void audio_close(void);
 void audio_render(int cpu_clocks);
+void audio_get_stats(struct audio_stats *stats);
+
+void audio_write_psg(uint8_t reg, uint8_t value);
+void audio_reset_psg(void);
+void audio_write_ym(uint8_t reg, uint8_t value);
+void audio_sync_pcm(void);
+
+void audio_set_gain(enum audio_source source, int percent);
+void audio_enable_meters(bool enable);
+bool audio_meters_enabled(void);
+void audio_get_meter(enum audio_source source, struct audio_meter *meter);
 
 void audio_usage(void);
@@ -0,0 +1,251 @@
+// Commander X16 Emulator
+// Copyright (c) 2019 Michael Steil
+// All rights reserved. License: 2-clause BSD
+
+// Renderer microbenchmarks. Every case sets up VERA through its registers
+// and renders frames without a window. A little state changes every frame,
+// so no line can be reused from the previous frame.
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include "glue.h"
+#include "video.h"
+#include "bench.h"
+
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 480
+
+#define ADDR_PSG_START     0x1F9C0
+#define ADDR_PALETTE_START 0x1FA00
+#define ADDR_SPRDATA_START 0x1FC00
+
+// only every Nth frame goes into the checksum, hashing is slower than rendering
+#define CHECKSUM_INTERVAL 16
+
+struct bench_case {
+	const char *name;
+	void (*setup)(void);
+	void (*animate)(uint32_t frame);
+};
+
+static uint32_t random_state;
+
+static uint8_t
+bench_random()
+{
+	random_state = random_state * 1664525 + 1013904223;
+	return random_state >> 24;
+}
+
+static void
+fill_random(uint32_t address, uint32_t size)
+{
+	uint8_t buf[1024];
+	while (size > 0) {
+		uint32_t n = size < sizeof(buf) ? size : sizeof(buf);
+		for (uint32_t i = 0; i < n; i++) {
+			buf[i] = bench_random();
+		}
+		video_space_write_range(address, 1, buf, n);
+		address += n;
+		size -= n;
+	}
+}
+
+static void
+write_layer(uint8_t layer, uint8_t config, uint8_t mapbase, uint8_t tilebase)
+{
+	video_write(0x0D + layer * 7, config);
+	video_write(0x0E + layer * 7, mapbase);
+	video_write(0x0F + layer * 7, tilebase);
+}
+
+static void
+write_scroll(uint8_t layer, uint16_t hscroll, uint16_t vscroll)
+{
+	video_write(0x10 + layer * 7, hscroll & 0xff);
+	video_write(0x11 + layer * 7, (hscroll >> 8) & 0x0f);
+	video_write(0x12 + layer * 7, vscroll & 0xff);
+	video_write(0x13 + layer * 7, (vscroll >> 8) & 0x0f);
+}
+
+static void
+write_display(uint8_t dc_video, uint8_t hscale, uint8_t vscale)
+{
+	video_write(0x05, 0); // DCSEL = 0
+	video_write(0x09, dc_video);
+	video_write(0x0A, hscale);
+	video_write(0x0B, vscale);
+}
+
+// 80x60 text, 1bpp 8x8 tiles in a 128x64 map on layer 1
+static void
+setup_text()
+{
+	fill_random(0x00000, 128 * 64 * 2);
+	fill_random(0x0F800, 256 * 8);
+	write_layer(1, 0x60, 0x00000 >> 9, (0x0F800 >> 11) << 2);
+	write_display(0x21, 128, 128);
+}
+
+static void
+animate_text(uint32_t frame)
+{
+	write_scroll(1, frame, 0);
+}
+
+// 4bpp 16x16 tiles in a 64x64 map on layer 0
+static void
+setup_tile_4bpp()
+{
+	fill_random(0x00000, 64 * 64 * 2);
+	fill_random(0x10000, 256 * 128);
+	write_layer(0, 0x52, 0x00000 >> 9, (0x10000 >> 11) << 2 | 3);
+	write_display(0x11, 128, 128);
+}
+
+// 8bpp 8x8 tiles in a 64x64 map on layer 0
+static void
+setup_tile_8bpp()
+{
+	fill_random(0x00000, 64 * 64 * 2);
+	fill_random(0x10000, 256 * 64);
+	write_layer(0, 0x53, 0x00000 >> 9, (0x10000 >> 11) << 2);
+	write_display(0x11, 128, 128);
+}
+
+static void
+animate_tile(uint32_t frame)
+{
+	write_scroll(0, frame, frame / 2);
+}
+
+// 640x480 8bpp bitmap on layer 0 (larger than VRAM, so it wraps)
+static void
+setup_bitmap()
+{
+	fill_random(0x00000, ADDR_PSG_START);
+	write_layer(0, 0x07, 0, 1); // bitmap at 0x00000, 640 pixels wide
+	write_display(0x11, 128, 128);
+}
+
+static void
+animate_bitmap(uint32_t frame)
+{
+	// the palette offset lives in HSCROLL_H for bitmap layers
+	video_write(0x11, frame & 0x0f);
+}
+
+// 128 sprites of 64x64 8bpp pixels, spread over the screen
+static void
+setup_sprites()
+{
+	fill_random(0x00000, 16 * 64 * 64);
+	for (int i = 0; i < 128; i++) {
+		uint32_t address = (i & 15) * 64 * 64;
+		uint16_t x = (i * 37) % SCREEN_WIDTH;
+		uint16_t y = (i * 59) % SCREEN_HEIGHT;
+		uint8_t sprite[8] = {
+			(address >> 5) & 0xff,
+			0x80 | (address >> 13),
+			x & 0xff, x >> 8,
+			y & 0xff, y >> 8,
+			3 << 2, // in front of both layers
+			0xf0,   // 64x64
+		};
+		video_space_write_range(ADDR_SPRDATA_START + i * 8, 1, sprite, sizeof(sprite));
+	}
+	write_display(0x41, 128, 128);
+}
+
+static void
+animate_sprites(uint32_t frame)
+{
+	for (int i = 0; i < 128; i++) {
+		uint16_t x = ((i * 37) + frame) % SCREEN_WIDTH;
+		video_space_write(ADDR_SPRDATA_START + i * 8 + 2, x & 0xff);
+		video_space_write(ADDR_SPRDATA_START + i * 8 + 3, x >> 8);
+	}
+}
+
+// 4bpp tile layer at 2x scale, i.e. 320x240
+static void
+setup_scaled()
+{
+	setup_tile_4bpp();
+	write_display(0x11, 64, 64);
+}
+
+// static 8bpp tile layer with 16 palette entries cycling every frame
+static void
+animate_palette(uint32_t frame)
+{
+	for (int i = 0; i < 16; i++) {
+		uint16_t color = ((frame + i) * 0x123) & 0xfff;
+		video_space_write(ADDR_PALETTE_START + (16 + i) * 2, color & 0xff);
+		video_space_write(ADDR_PALETTE_START + (16 + i) * 2 + 1, color >> 8);
+	}
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "text 80x60",        setup_text,      animate_text },
+	{ "tile 4bpp 16x16",   setup_tile_4bpp, animate_tile },
+	{ "tile 8bpp 8x8",     setup_tile_8bpp, animate_tile },
+	{ "bitmap 640x480",    setup_bitmap,    animate_bitmap },
+	{ "sprites 128x64x64", setup_sprites,   animate_sprites },
+	{ "scaled 320x240",    setup_scaled,    animate_tile },
+	{ "palette animation", setup_tile_8bpp, animate_palette },
+};
+
+static void
+render_frame()
+{
+	while (!video_step(MHZ, 1000)) {
+	}
+}
+
+static uint32_t
+checksum_frame(uint32_t hash)
+{
+	const uint8_t *pixels = video_get_framebuffer();
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT * 4; i++) {
+		hash = (hash ^ pixels[i]) * 16777619;
+	}
+	return hash;
+}
+
+void
+bench_run(uint32_t frames)
+{
+	static uint8_t zero[ADDR_PSG_START];
+	const uint64_t frequency = SDL_GetPerformanceFrequency();
+
+	printf("%-20s %8s %12s %10s %10s\n", "case", "frames", "ns/frame", "ns/line", "checksum");
+	for (int c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); c++) {
+		const struct bench_case *bench = &bench_cases[c];
+
+		// start every case from the same state
+		video_reset();
+		video_space_write_range(0x00000, 1, zero, ADDR_PSG_START);
+		video_space_write_range(ADDR_SPRDATA_START, 1, zero, 0x400);
+		random_state = 1;
+		bench->setup();
+		render_frame();
+
+		uint64_t ticks = 0;
+		uint32_t hash = 2166136261u;
+		for (uint32_t frame = 0; frame < frames; frame++) {
+			bench->animate(frame);
+			uint64_t start = SDL_GetPerformanceCounter();
+			render_frame();
+			ticks += SDL_GetPerformanceCounter() - start;
+			if (frame % CHECKSUM_INTERVAL == 0 || frame == frames - 1) {
+				hash = checksum_frame(hash);
+			}
+		}
+
+		double ns_per_frame = (double)ticks * 1e9 / frequency / frames;
+		printf("%-20s %8u %12.0f %10.1f   %08x\n", bench->name, frames, ns_per_frame, ns_per_frame / SCREEN_HEIGHT, hash);
+	}
+}
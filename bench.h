@@ -0,0 +1,14 @@
+// Commander X16 Emulator
+// Copyright (c) 2019 Michael Steil
+// All rights reserved. License: 2-clause BSD
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <stdint.h>
+
+#define BENCH_DEFAULT_FRAMES 2000
+
+void bench_run(uint32_t frames);
+
+#endif
@@ -19,6 +19,7 @@
 #include "disasm.h"
 #include "memory.h"
 #include "video.h"
+#include "audio.h"
 #include "cpu/fake6502.h"
 #include "debugger.h"
 #include "rendertext.h"
@@ -372,6 +373,7 @@ static void DEBUGExecCmd() {
 
 		case CMD_FILL_MEMORY:
 			size = 1;
+			incr = 0;
 			sscanf(line, "%x %x %d %d", &addr, &number, &size, &incr);
 
 			if (dumpmode == DDUMP_RAM) {
@@ -393,17 +395,15 @@ static void DEBUGExecCmd() {
 					--size;
 				} while (size > 0);
 			} else {
-				addr &= 0x1FFFF;
-				do {
-					video_space_write(addr, number);
-					if (incr) {
-						addr += incr;
-					} else {
-						++addr;
-					}
-					addr &= 0x1FFFF;
-					--size;
-				} while (size > 0);
+				if (size < 1) {
+					size = 1;
+				}
+				uint8_t *fill = malloc(size);
+				if (fill) {
+					memset(fill, number, size);
+					video_space_write_range(addr & 0x1FFFF, incr ? incr : 1, fill, size);
+					free(fill);
+				}
 			}
 			break;
 
@@ -650,6 +650,18 @@ static int DEBUGRenderRegisters(void) {
 	DEBUGNumber(DBG_DATX, yc++, video_read(4, true), 2, col_data);
 	DEBUGNumber(DBG_DATX, yc++, video_read(5, true), 2, col_data);
 
+	if (audio_meters_enabled()) {								// Audio peak levels, louder channel
+		static char *sources[] = { "PSG","PCM","YM","MIX" };
+		for (int i = 0; i < AUDIO_SOURCES; i++) {
+			struct audio_meter meter;
+			audio_get_meter(i, &meter);
+			int level = (meter.peak[0] > meter.peak[1] ? meter.peak[0] : meter.peak[1]) >> 7;
+			int x = DBG_LBLX + (i & 1) * 7;
+			DEBUGString(dbgRenderer, x, yc + i / 2, sources[i], col_label);
+			DEBUGNumber(x + 4, yc + i / 2, level > 255 ? 255 : level, 2, col_data);
+		}
+	}
+
 	return n; 													// Number of code display lines
 }
 
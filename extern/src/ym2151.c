@@ -54,6 +54,7 @@ void YM_ym2151_reset_chip();
  signed int YM_op_calc1(YM2151Operator * OP, unsigned int env, signed int pm);
  void YM_chan_calc(unsigned int chan);
  void YM_chan7_calc();
+ int YM_chan_silent(unsigned int chan);
  void YM_advance_eg();
  void YM_advance();
 
@@ -64,6 +65,8 @@ signed int     mem;                 /* one sample delay memory */
 
 YM2151Operator oper[32];            /* the 32 operators */
 
+uint32_t       chan_active;         /* channels that can produce sound (bit per channel); all others are skipped */
+
 uint32_t       pan[16];             /* channels output masks (0xffffffff = enable) */
 
 uint32_t       eg_cnt;              /* global envelope generator counter */
@@ -182,15 +185,23 @@ uint32_t       noise_tab[32];       /* 17bit Noise Generator periods */
 *   TL_RES_LEN - sinus resolution (X axis)
 */
 #define TL_TAB_LEN (13*2*TL_RES_LEN)
-static signed int tl_tab[TL_TAB_LEN];
 
 #define ENV_QUIET        (TL_TAB_LEN>>3)
 
+#ifdef YM_GENTABLES
+static signed int tl_tab[TL_TAB_LEN];
+
 /* sin waveform table in 'decibel' scale */
 static unsigned int sin_tab[SIN_LEN];
 
 /* translate from D1L to volume index (16 D1L levels) */
 static uint32_t d1l_tab[16];
+#else
+/* tl_tab, sin_tab, d1l_tab and the chip tables for one clock and sampling
+*  rate are computed at build time by ym2151_gentables.c
+*/
+#include "ym2151_tables.h"
+#endif
 
 #define RATE_STEPS (8)
 static const uint8_t eg_inc[19*RATE_STEPS]={
@@ -458,6 +469,7 @@ void YM_Create(uint32_t clock)
 
 void YM_init_tables()
 {
+#ifdef YM_GENTABLES
     signed int i,x,n;
     double o,m;
 
@@ -526,6 +538,7 @@ void YM_init_tables()
         d1l_tab[i] = (uint32_t) m;
         /*logerror("d1l_tab[%02x]=%08x\n",i,d1l_tab[i] );*/
     }
+#endif
 
 #ifdef SAVE_SAMPLE
     sample[8]=fopen("sampsum.pcm","wb");
@@ -550,6 +563,25 @@ void YM_init_chip_tables()
     double scaler;
     double pom;
 
+    /* the tables still hold the values for this clock and rate */
+    static int tables_clock, tables_sampfreq;
+    if (YM_clock == tables_clock && YM_sampfreq == tables_sampfreq)
+        return;
+    tables_clock    = YM_clock;
+    tables_sampfreq = YM_sampfreq;
+
+#ifndef YM_GENTABLES
+    if (YM_clock == YM_PRESET_CLOCK && YM_sampfreq == YM_PRESET_SAMPFREQ)
+    {
+        memcpy(freq,      preset_freq,      sizeof(freq));
+        memcpy(dt1_freq,  preset_dt1_freq,  sizeof(dt1_freq));
+        memcpy(tim_A_tab, preset_tim_A_tab, sizeof(tim_A_tab));
+        memcpy(tim_B_tab, preset_tim_B_tab, sizeof(tim_B_tab));
+        memcpy(noise_tab, preset_noise_tab, sizeof(noise_tab));
+        return;
+    }
+#endif
+
     scaler = ( (double)YM_clock / 64.0 ) / ( (double)YM_sampfreq );
     /*logerror("scaler    = %20.15f\n", scaler);*/
 
@@ -692,6 +724,7 @@ void YM_init_chip_tables()
         {                                                       \
             (op)->phase = 0;            /* clear phase */       \
             (op)->state = EG_ATT;        /* KEY ON = attack */  \
+            chan_active |= 1 << (((op) - oper) >> 2);           \
             (op)->volume += (~(op)->volume *                    \
                            (eg_inc[(op)->eg_sel_ar + ((eg_cnt>>(op)->eg_sh_ar)&7)])    \
                           ) >>4;                                \
@@ -1387,6 +1420,8 @@ void YM_ym2151_reset_chip()
     chanout[6] = 0;
     chanout[7] = 0;
 
+    chan_active = 0;
+
     eg_timer = 0;
     eg_cnt   = 0;
 
@@ -1575,6 +1610,19 @@ void YM_chan7_calc()
     op->mem_value = mem;
 }
 
+/*  A channel is silent when all its operators are off and the feedback
+*   and delay memory have run empty: calculating it again changes nothing,
+*   and the phase of an operator that is off gets cleared by its next KEY ON.
+*/
+int YM_chan_silent(unsigned int chan)
+{
+    YM2151Operator *op = &oper[chan*4];
+
+    return op[0].state == EG_OFF && op[1].state == EG_OFF &&
+           op[2].state == EG_OFF && op[3].state == EG_OFF &&
+           !op->fb_out_prev && !op->fb_out_curr && !op->mem_value;
+}
+
 /*
 The 'rate' is calculated from following formula (example on decay rate):
   rks = notecode after key scaling (a value from 0 to 31)
@@ -1792,11 +1840,17 @@ void YM_advance_eg()
 
         eg_cnt++;
 
-        /* envelope generator */
+        /* envelope generator, operators of silent channels are all off */
         op = &oper[0];    /* CH 0 M1 */
         i = 32;
         do
         {
+            if (!(chan_active & (1 << ((32 - i) >> 2))))
+            {
+                op += 4;
+                i -= 4;
+                continue;
+            }
             switch(op->state)
             {
             case EG_ATT:    /* attack phase */
@@ -1969,7 +2023,9 @@ void YM_advance()
     i = 8;
     do
     {
-        if (op->pms)    /* only when phase modulation from LFO is enabled for this channel */
+        if (!(chan_active & (1 << (8 - i))))
+            ;   /* silent channel */
+        else if (op->pms)    /* only when phase modulation from LFO is enabled for this channel */
         {
             int32_t mod_ind = lfp;        /* -128..+127 (8bits signed) */
             if (op->pms < 6)
@@ -2053,6 +2109,7 @@ void YM_advance()
 void YM_stream_update(uint16_t* stream, int samples)
 {
     uint32_t i;
+    unsigned int c;
     int32_t outl,outr;
 
 #ifdef USE_MAME_TIMERS
@@ -2079,6 +2136,14 @@ void YM_stream_update(uint16_t* stream, int samples)
     {
         YM_advance_eg();
 
+        if (!chan_active)
+        {
+            /* idle chip, only the timers, LFO and noise keep running */
+            stream[2 * i] = 0;
+            stream[2 * i + 1] = 0;
+            goto timers;
+        }
+
         chanout[0] = 0;
         chanout[1] = 0;
         chanout[2] = 0;
@@ -2088,14 +2153,21 @@ void YM_stream_update(uint16_t* stream, int samples)
         chanout[6] = 0;
         chanout[7] = 0;
 
-        YM_chan_calc(0);
-        YM_chan_calc(1);
-        YM_chan_calc(2);
-        YM_chan_calc(3);
-        YM_chan_calc(4);
-        YM_chan_calc(5);
-        YM_chan_calc(6);
-        YM_chan7_calc();
+        for (c=0; c<7; c++)
+        {
+            if (chan_active & (1 << c))
+            {
+                YM_chan_calc(c);
+                if (YM_chan_silent(c))
+                    chan_active &= ~(1 << c);
+            }
+        }
+        if (chan_active & 0x80)
+        {
+            YM_chan7_calc();
+            if (YM_chan_silent(7))
+                chan_active &= ~0x80;
+        }
 
         outl = chanout[0] & pan[0];
         outr = chanout[0] & pan[1];
@@ -2124,6 +2196,7 @@ void YM_stream_update(uint16_t* stream, int samples)
         stream[2 * i] = (int16_t) outl;
         stream[2 * i + 1] = (int16_t) outr;
 
+timers:
 #ifdef USE_MAME_TIMERS
         /* ASG 980324 - handled by real timers now */
 #else
@@ -0,0 +1,60 @@
+// Commander X16 Emulator
+// Copyright (c) 2020 Frank van den Hoef
+// All rights reserved. License: 2-clause BSD
+
+// Computes the lookup tables of the YM2151 emulation on the build host and
+// prints them as a header for ym2151.c, so the emulator doesn't compute
+// them on every start. The frequency, detune, timer and noise tables depend
+// on the chip clock and the sampling rate, which are passed as arguments;
+// for any other clock or rate, they are still computed at runtime.
+//
+// usage: ym2151_gentables <clock> <sampling rate> > ym2151_tables.h
+
+#define YM_GENTABLES
+#include "ym2151.c"
+
+#include <stdio.h>
+
+static void
+print_table(const char *decl, const void *table, int count, int is_signed)
+{
+	printf("%s = {", decl);
+	for (int i = 0; i < count; i++) {
+		if (i % 8 == 0) {
+			printf("\n\t");
+		}
+		if (is_signed) {
+			printf("%d,", ((const int32_t *)table)[i]);
+		} else {
+			printf("0x%x,", ((const uint32_t *)table)[i]);
+		}
+	}
+	printf("\n};\n\n");
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc != 3) {
+		fprintf(stderr, "usage: %s <clock> <sampling rate>\n", argv[0]);
+		return 1;
+	}
+	const int clock = atoi(argv[1]);
+	const int rate  = atoi(argv[2]);
+
+	YM_Create(clock);
+	YM_init(rate, 60);
+
+	printf("// Generated by ym2151_gentables.c, do not edit.\n\n");
+	printf("#define YM_PRESET_CLOCK    %d\n", clock);
+	printf("#define YM_PRESET_SAMPFREQ %d\n\n", rate);
+	print_table("static const signed int tl_tab[TL_TAB_LEN]", tl_tab, TL_TAB_LEN, 1);
+	print_table("static const unsigned int sin_tab[SIN_LEN]", sin_tab, SIN_LEN, 0);
+	print_table("static const uint32_t d1l_tab[16]", d1l_tab, 16, 0);
+	print_table("static const uint32_t preset_freq[11*768]", freq, 11 * 768, 0);
+	print_table("static const int32_t preset_dt1_freq[8*32]", dt1_freq, 8 * 32, 1);
+	print_table("static const uint32_t preset_tim_A_tab[1024]", tim_A_tab, 1024, 0);
+	print_table("static const uint32_t preset_tim_B_tab[256]", tim_B_tab, 256, 0);
+	print_table("static const uint32_t preset_noise_tab[32]", noise_tab, 32, 0);
+	return 0;
+}
@@ -56,8 +56,11 @@ extern echo_mode_t echo_mode;
 extern bool save_on_exit;
 extern gif_recorder_state_t record_gif;
 extern char *gif_path;
+extern bool gif_drop_frames;
+extern char *video_out_path;
 extern uint8_t keymap;
 extern bool warp_mode;
+extern bool headless;
 
 extern void machine_dump();
 extern void machine_reset();
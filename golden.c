@@ -0,0 +1,129 @@
+// Commander X16 Emulator
+// Copyright (c) 2019 Michael Steil
+// All rights reserved. License: 2-clause BSD
+
+// Golden-frame regression runs: in headless mode, the emulator hashes the
+// rendered picture, the mixed audio and RAM after every frame. The hashes
+// are written to a log, one line per frame, and/or compared against a log
+// recorded earlier.
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL.h>
+#include "glue.h"
+#include "video.h"
+#include "golden.h"
+
+#define SCREEN_WIDTH 640
+#define SCREEN_HEIGHT 480
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME  16777619u
+
+static FILE *log_file;
+static FILE *ref_file;
+static uint32_t frame_count;
+static uint32_t frame_limit;
+static uint32_t audio_hash = FNV_OFFSET;
+static bool diverged;
+
+static uint32_t
+hash_bytes(uint32_t hash, const uint8_t *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * FNV_PRIME;
+	}
+	return hash;
+}
+
+bool
+golden_init(const char *log_path, const char *ref_path, uint32_t max_frames)
+{
+	if (log_path) {
+		log_file = !strcmp(log_path, "-") ? stdout : fopen(log_path, "w");
+		if (!log_file) {
+			fprintf(stderr, "Cannot open %s for writing.\n", log_path);
+			return false;
+		}
+	}
+	if (ref_path) {
+		ref_file = fopen(ref_path, "r");
+		if (!ref_file) {
+			fprintf(stderr, "Cannot open %s!\n", ref_path);
+			return false;
+		}
+	}
+	frame_count = 0;
+	frame_limit = max_frames;
+	audio_hash = FNV_OFFSET;
+	diverged = false;
+	return true;
+}
+
+// mixed audio samples generated during the current frame
+void
+golden_audio(const int16_t *samples, int count)
+{
+	for (int i = 0; i < count; i++) {
+		uint8_t bytes[2] = { samples[i] & 0xff, (samples[i] >> 8) & 0xff };
+		audio_hash = hash_bytes(audio_hash, bytes, 2);
+	}
+}
+
+// Hash the frame that just ended. Returns false once the run is over:
+// the frame limit was reached, the reference log ended, or the output
+// diverged from it.
+bool
+golden_frame()
+{
+	uint32_t hashes[3];
+	hashes[0] = hash_bytes(FNV_OFFSET, video_get_framebuffer(), SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+	hashes[1] = audio_hash;
+	hashes[2] = hash_bytes(FNV_OFFSET, RAM, RAM_SIZE);
+	audio_hash = FNV_OFFSET;
+
+	if (log_file) {
+		fprintf(log_file, "%u %08x %08x %08x\n", frame_count, hashes[0], hashes[1], hashes[2]);
+	}
+
+	if (ref_file) {
+		static const char *names[3] = { "video", "audio", "RAM" };
+		uint32_t ref_frame;
+		uint32_t ref[3];
+		if (fscanf(ref_file, "%u %x %x %x", &ref_frame, &ref[0], &ref[1], &ref[2]) != 4) {
+			// reference log ended, everything matched
+			return false;
+		}
+		for (int i = 0; i < 3; i++) {
+			if (hashes[i] != ref[i]) {
+				fprintf(stderr, "Frame %u diverges: %s hash is %08x, expected %08x.\n", frame_count, names[i], hashes[i], ref[i]);
+				diverged = true;
+			}
+		}
+		if (diverged) {
+			frame_count++;
+			return false;
+		}
+	}
+
+	frame_count++;
+	return !frame_limit || frame_count < frame_limit;
+}
+
+// Returns the exit status: 1 if the run diverged from the reference.
+int
+golden_close()
+{
+	if (log_file && log_file != stdout) {
+		fclose(log_file);
+	}
+	log_file = NULL;
+	if (ref_file) {
+		fclose(ref_file);
+		if (!diverged) {
+			fprintf(stderr, "%u frames match the reference.\n", frame_count);
+		}
+	}
+	ref_file = NULL;
+	return diverged ? 1 : 0;
+}
@@ -0,0 +1,16 @@
+// Commander X16 Emulator
+// Copyright (c) 2019 Michael Steil
+// All rights reserved. License: 2-clause BSD
+
+#ifndef _GOLDEN_H_
+#define _GOLDEN_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+bool golden_init(const char *log_path, const char *ref_path, uint32_t max_frames);
+bool golden_frame(void);
+void golden_audio(const int16_t *samples, int count);
+int golden_close(void);
+
+#endif
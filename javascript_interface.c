@@ -28,7 +28,7 @@ void
 j2c_start_audio(bool start)
 {
 	if (start)
-		audio_init(NULL, 8);
+		audio_init(NULL, 8 * AUDIO_SAMPLES_PER_BUFFER, NULL, false);
 	else
 		audio_close();
 }
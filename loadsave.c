@@ -153,18 +153,20 @@ LOAD()
 		size_t bytes_read = 0;
 		if(a > 1) {
 			// Video RAM
-			video_write(0, start & 0xff);
-			video_write(1, start >> 8);
-			video_write(2, ((a - 2) & 0xf) | 0x10);
+			uint8_t addr_hi = ((a - 2) & 0xf) | 0x10;
+			uint32_t addr = (addr_hi & 1) << 16 | start;
+			int stride = (addr_hi & 0x08) ? -1 : 1;
 			uint8_t buf[2048];
 			while(1) {
 				size_t n = SDL_RWread(f, buf, 1, sizeof buf);
 				if(n == 0) break;
-				for(size_t i = 0; i < n; i++) {
-					video_write(3, buf[i]);
-				}
+				addr = video_space_write_range(addr, stride, buf, n);
 				bytes_read += n;
 			}
+			// leave the data port pointing past the loaded data
+			video_write(0, addr & 0xff);
+			video_write(1, addr >> 8);
+			video_write(2, (addr_hi & ~1) | (addr >> 16));
 		} else if(start < 0x9f00) {
 			// Fixed RAM
 			bytes_read = SDL_RWread(f, RAM + start, 1, 0x9f00 - start);
@@ -33,6 +33,8 @@
 #include "rom_symbols.h"
 #include "ym2151.h"
 #include "audio.h"
+#include "bench.h"
+#include "golden.h"
 #include "version.h"
 
 #ifdef __EMSCRIPTEN__
@@ -40,7 +42,11 @@
 #include <pthread.h>
 #endif
 
+// with -frameskip, at most this many frames in a row are skipped
+#define MAX_FRAMESKIP 4
+
 void *emulator_loop(void *param);
+int emulator_thread(void *param);
 void emscripten_main_loop(void);
 
 // This must match the KERNAL's set!
@@ -78,18 +84,26 @@ bool dump_ram = true;
 bool dump_bank = true;
 bool dump_vram = false;
 bool warp_mode = false;
+bool headless = false;
 echo_mode_t echo_mode;
 bool save_on_exit = true;
 gif_recorder_state_t record_gif = RECORD_GIF_DISABLED;
 char *gif_path = NULL;
+bool gif_drop_frames = false;
+char *video_out_path = NULL;
 uint8_t keymap = 0; // KERNAL's default
 int window_scale = 1;
 char *scale_quality = "best";
+bool video_thread = false;
+bool present_thread = false;
+bool auto_frameskip = false;
+uint32_t bench_frames = 0;
 
 int frames;
 int32_t sdlTicks_base;
 int32_t last_perf_update;
 int32_t perf_frame_count;
+int skipped_frames;
 char window_title[30];
 
 #ifdef TRACE
@@ -249,6 +263,17 @@ timing_update()
 		usleep(1000 * diff_time);
 	}
 
+	// if this frame was late, skip rendering the next one, but keep
+	// showing at least every few frames
+	if (auto_frameskip && !warp_mode) {
+		if (diff_time < 0 && skipped_frames < MAX_FRAMESKIP) {
+			video_skip_frame();
+			skipped_frames++;
+		} else {
+			skipped_frames = 0;
+		}
+	}
+
 	if (sdlTicks - last_perf_update > 5000) {
 		int32_t frameCount = frames - perf_frame_count;
 		int perf = frameCount / 3;
@@ -424,10 +449,29 @@ usage()
 	printf("\tPOKE $9FB5,2 to start recording.\n");
 	printf("\tPOKE $9FB5,1 to capture a single frame.\n");
 	printf("\tPOKE $9FB5,0 to pause.\n");
+	printf("-gifdrop\n");
+	printf("\tDrop GIF frames instead of slowing down emulation\n");
+	printf("\twhen the encoder falls behind.\n");
+	printf("-video-out <file.y4m|file.raw|->\n");
+	printf("\tCapture the video output for an external encoder,\n");
+	printf("\tas YUV4MPEG2, or as color indices and palette changes\n");
+	printf("\tif the filename ends in .raw. - writes to stdout.\n");
+	printf("-audio-out <file.wav>\n");
+	printf("\tCapture the audio output into a WAV file. Files not ending\n");
+	printf("\tin .wav get raw 16 bit little-endian samples.\n");
+	printf("-audio-split\n");
+	printf("\tCapture PSG, PCM and YM2151 output separately, as 6 channels.\n");
 	printf("-scale {1|2|3|4}\n");
 	printf("\tScale output to an integer multiple of 640x480\n");
 	printf("-quality {nearest|linear|best}\n");
 	printf("\tScaling algorithm quality\n");
+	printf("-frameskip\n");
+	printf("\tSkip rendering frames when the host can't keep up.\n");
+	printf("-vthread\n");
+	printf("\tRender video on a separate thread.\n");
+	printf("-vpresent\n");
+	printf("\tPresent video and handle input on a separate thread,\n");
+	printf("\tsynchronized to the display refresh.\n");
 	printf("-debug [<address>]\n");
 	printf("\tEnable debugger. Optionally, set a breakpoint\n");
 	printf("-dump {C|R|B|V}...\n");
@@ -439,15 +483,37 @@ usage()
 	printf("\tChoose what type of joystick to use, e.g. -joy2 SNES\n");
 	printf("-sound <output device>\n");
 	printf("\tSet the output device used for audio emulation\n");
+	printf("\tUse \"none\" to run without sound.\n");
 	printf("-abufs <number of audio buffers>\n");
 	printf("\tSet the number of audio buffers used for playback. (default: 8)\n");
 	printf("\tIncreasing this will reduce stutter on slower computers,\n");
 	printf("\tbut will increase audio latency.\n");
+	printf("-asamples <number of samples>\n");
+	printf("\tSet the size of the playback buffer in samples, rounded up\n");
+	printf("\tto a power of two. (default: 8 audio buffers)\n");
+	printf("-astats\n");
+	printf("\tPrint fill levels of the playback buffer on exit.\n");
+	printf("-again <psg>,<pcm>,<ym>\n");
+	printf("\tSet the mixing gain of each source in percent, 0 to 400.\n");
+	printf("\tThe mix saturates instead of wrapping. (default: 33,33,33)\n");
+	printf("-ameters\n");
+	printf("\tMeasure the peak and RMS level of every source, shown\n");
+	printf("\tin the debugger and readable through $9FB6/$9FB7.\n");
 #ifdef TRACE
 	printf("-trace [<address>]\n");
 	printf("\tPrint instruction trace. Optionally, a trigger address\n");
 	printf("\tcan be specified.\n");
 #endif
+	printf("-hashlog <file>\n");
+	printf("\tRun without a window and log hashes of the video, audio\n");
+	printf("\tand RAM contents of every frame.\n");
+	printf("-hashcheck <file>\n");
+	printf("\tRun without a window and compare every frame against a\n");
+	printf("\tlog written by -hashlog, stopping at the first difference.\n");
+	printf("-frames <number of frames>\n");
+	printf("\tStop a -hashlog or -hashcheck run after this many frames.\n");
+	printf("-bench [<frames>]\n");
+	printf("\tRun the video renderer benchmarks and exit. (default: %d frames)\n", BENCH_DEFAULT_FRAMES);
 	printf("-version\n");
 	printf("\tPrint additional version information the emulator and ROM.\n");
 	printf("\n");
@@ -477,9 +543,15 @@ main(int argc, char **argv)
 	bool run_geos = false;
 	bool run_test = false;
 	int test_number = 0;
-	int audio_buffers = 8;
+	int audio_samples = 8 * AUDIO_SAMPLES_PER_BUFFER;
+	bool audio_stats = false;
 
 	const char *audio_dev_name = NULL;
+	const char *audio_out_path = NULL;
+	bool audio_split = false;
+	const char *hash_log_path = NULL;
+	const char *hash_ref_path = NULL;
+	uint32_t max_frames = 0;
 
 	run_after_load = false;
 
@@ -669,6 +741,32 @@ main(int argc, char **argv)
 			gif_path = argv[0];
 			argv++;
 			argc--;
+		} else if (!strcmp(argv[0], "-gifdrop")) {
+			argc--;
+			argv++;
+			gif_drop_frames = true;
+		} else if (!strcmp(argv[0], "-video-out")) {
+			argc--;
+			argv++;
+			if (!argc || (argv[0][0] == '-' && argv[0][1])) {
+				usage();
+			}
+			video_out_path = argv[0];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-audio-out")) {
+			argc--;
+			argv++;
+			if (!argc || argv[0][0] == '-') {
+				usage();
+			}
+			audio_out_path = argv[0];
+			argv++;
+			argc--;
+		} else if (!strcmp(argv[0], "-audio-split")) {
+			argv++;
+			argc--;
+			audio_split = true;
 		} else if (!strcmp(argv[0], "-debug")) {
 			argc--;
 			argv++;
@@ -781,6 +879,18 @@ main(int argc, char **argv)
 			}
 			argc--;
 			argv++;
+		} else if (!strcmp(argv[0], "-frameskip")) {
+			argc--;
+			argv++;
+			auto_frameskip = true;
+		} else if (!strcmp(argv[0], "-vthread")) {
+			argc--;
+			argv++;
+			video_thread = true;
+		} else if (!strcmp(argv[0], "-vpresent")) {
+			argc--;
+			argv++;
+			present_thread = true;
 		} else if (!strcmp(argv[0], "-sound")) {
 			argc--;
 			argv++;
@@ -796,9 +906,75 @@ main(int argc, char **argv)
 			if (!argc || argv[0][0] == '-') {
 				usage();
 			}
-			audio_buffers = (int)strtol(argv[0], NULL, 10);
+			audio_samples = (int)strtol(argv[0], NULL, 10) * AUDIO_SAMPLES_PER_BUFFER;
+			argc--;
+			argv++;
+		} else if (!strcmp(argv[0], "-asamples")) {
+			argc--;
+			argv++;
+			if (!argc || argv[0][0] == '-') {
+				usage();
+			}
+			audio_samples = (int)strtol(argv[0], NULL, 10);
+			argc--;
+			argv++;
+		} else if (!strcmp(argv[0], "-astats")) {
+			argc--;
+			argv++;
+			audio_stats = true;
+		} else if (!strcmp(argv[0], "-again")) {
+			argc--;
+			argv++;
+			int psg, pcm, ym;
+			if (!argc || sscanf(argv[0], "%d,%d,%d", &psg, &pcm, &ym) != 3 ||
+				psg < 0 || psg > 400 || pcm < 0 || pcm > 400 || ym < 0 || ym > 400) {
+				usage();
+			}
+			audio_set_gain(AUDIO_SOURCE_PSG, psg);
+			audio_set_gain(AUDIO_SOURCE_PCM, pcm);
+			audio_set_gain(AUDIO_SOURCE_YM, ym);
 			argc--;
 			argv++;
+		} else if (!strcmp(argv[0], "-ameters")) {
+			argc--;
+			argv++;
+			audio_enable_meters(true);
+		} else if (!strcmp(argv[0], "-hashlog")) {
+			argc--;
+			argv++;
+			if (!argc || (argv[0][0] == '-' && argv[0][1])) {
+				usage();
+			}
+			hash_log_path = argv[0];
+			argc--;
+			argv++;
+		} else if (!strcmp(argv[0], "-hashcheck")) {
+			argc--;
+			argv++;
+			if (!argc || argv[0][0] == '-') {
+				usage();
+			}
+			hash_ref_path = argv[0];
+			argc--;
+			argv++;
+		} else if (!strcmp(argv[0], "-frames")) {
+			argc--;
+			argv++;
+			if (!argc || argv[0][0] == '-') {
+				usage();
+			}
+			max_frames = (uint32_t)strtol(argv[0], NULL, 10);
+			argc--;
+			argv++;
+		} else if (!strcmp(argv[0], "-bench")) {
+			argc--;
+			argv++;
+			bench_frames = BENCH_DEFAULT_FRAMES;
+			if (argc && argv[0][0] != '-') {
+				bench_frames = (uint32_t)strtol(argv[0], NULL, 10);
+				argc--;
+				argv++;
+			}
 		} else if (!strcmp(argv[0], "-version")){
 			printf("%s", VER_INFO);
 			argc--;
@@ -809,6 +985,11 @@ main(int argc, char **argv)
 		}
 	}
 
+	if (bench_frames) {
+		bench_run(bench_frames);
+		return 0;
+	}
+
 	SDL_RWops *f = SDL_RWFromFile(rom_path, "rb");
 	if (!f) {
 		printf("Cannot open %s!\n", rom_path);
@@ -866,14 +1047,27 @@ main(int argc, char **argv)
 		snprintf(paste_text, sizeof(paste_text_data), "TEST %d\r", test_number);
 	}
 
-	SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO);
+	// regression runs have no window, no audio device and no input
+	headless = hash_log_path || hash_ref_path;
 
-	audio_init(audio_dev_name, audio_buffers);
+	if (headless) {
+		SDL_Init(0);
+	} else {
+		SDL_Init(SDL_INIT_VIDEO | SDL_INIT_EVENTS | SDL_INIT_GAMECONTROLLER | SDL_INIT_AUDIO);
+	}
+
+	audio_init(audio_dev_name, audio_samples, audio_out_path, audio_split);
 
 	memory_init();
-	video_init(window_scale, scale_quality);
+	if (headless) {
+		if (!golden_init(hash_log_path, hash_ref_path, max_frames)) {
+			exit(1);
+		}
+	} else {
+		video_init(window_scale, scale_quality, video_thread, present_thread);
 
-	joystick_init();
+		joystick_init();
+	}
 
 	machine_reset();
 
@@ -884,11 +1078,34 @@ main(int argc, char **argv)
 #ifdef __EMSCRIPTEN__
 	emscripten_set_main_loop(emscripten_main_loop, 0, 1);
 #else
-	emulator_loop(NULL);
+	if (video_present_threaded()) {
+		// the main thread owns the window, so it presents and polls events
+		SDL_Thread *emulator = SDL_CreateThread(emulator_thread, "emulator", NULL);
+		if (!emulator) {
+			fprintf(stderr, "SDL_CreateThread failed: %s\n", SDL_GetError());
+			exit(1);
+		}
+		video_present_loop();
+		SDL_WaitThread(emulator, NULL);
+	} else {
+		emulator_loop(NULL);
+	}
 #endif
 
+	int exit_code = 0;
+	// the stats are final once the synthesis thread has stopped
 	audio_close();
-	video_end();
+	if (audio_stats) {
+		struct audio_stats stats;
+		audio_get_stats(&stats);
+		printf("Audio buffer: %u samples, fill min/avg/max %u/%u/%u, %u samples dropped, %u underruns\n",
+			stats.size, stats.fill_min, stats.fill_avg, stats.fill_max, stats.dropped, stats.underruns);
+	}
+	if (headless) {
+		exit_code = golden_close();
+	} else {
+		video_end();
+	}
 	SDL_Quit();
 
 #ifdef PERFSTAT
@@ -917,7 +1134,7 @@ main(int argc, char **argv)
 	}
 #endif
 
-	return 0;
+	return exit_code;
 }
 
 void
@@ -925,6 +1142,14 @@ emscripten_main_loop(void) {
 	emulator_loop(NULL);
 }
 
+int
+emulator_thread(void *param)
+{
+	emulator_loop(param);
+	video_present_stop();
+	return 0;
+}
+
 
 void*
 emulator_loop(void *param)
@@ -1027,24 +1252,30 @@ emulator_loop(void *param)
 		uint32_t old_clockticks6502 = clockticks6502;
 		step6502();
 		uint8_t clocks = clockticks6502 - old_clockticks6502;
-		bool new_frame = false;
 		for (uint8_t i = 0; i < clocks; i++) {
 			ps2_step(0);
 			ps2_step(1);
 			joystick_step();
 			vera_spi_step();
-			new_frame |= video_step(MHZ);
 		}
+		bool new_frame = video_step(MHZ, clocks);
 		audio_render(clocks);
 
 		instruction_counter++;
 
 		if (new_frame) {
-			if (!video_update()) {
-				break;
-			}
+			if (headless) {
+				// as fast as possible, and independent of the host
+				if (!golden_frame()) {
+					break;
+				}
+			} else {
+				if (!video_update()) {
+					break;
+				}
 
-			timing_update();
+				timing_update();
+			}
 #ifdef __EMSCRIPTEN__
 			// After completing a frame we yield back control to the browser to stay responsive
 			return 0;
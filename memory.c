@@ -10,7 +10,7 @@
 #include "via.h"
 #include "memory.h"
 #include "video.h"
-#include "ym2151.h"
+#include "audio.h"
 #include "ps2.h"
 #include "cpu/fake6502.h"
 
@@ -22,6 +22,7 @@ uint8_t ROM[ROM_SIZE];
 
 bool led_status;
 static uint8_t addr_ym = 0;
+static uint8_t meter_select = 0;
 
 #define DEVICE_EMULATOR (0x9fb0)
 
@@ -111,7 +112,7 @@ write6502(uint16_t address, uint8_t value)
 			if (address == 0x9f40) {        // YM address
 				addr_ym = value;
 			} else if (address == 0x9f41) { // YM data
-				YM_write_reg(addr_ym, value);
+				audio_write_ym(addr_ym, value);
 			}
 			// TODO:
 			//   $9F42 & $9F43: SAA1099P
@@ -224,6 +225,9 @@ emu_recorder_set(gif_recorder_command_t command)
 // 3: echo_mode
 // 4: save_on_exit
 // 5: record_gif
+// 6: audio meter select (bits 0-1: PSG/PCM/YM/mix, bit 2: right, bit 3: RMS);
+//    writing it turns the meters on
+// 7: audio meter level (read only)
 // POKE $9FB3,1:PRINT"ECHO MODE IS ON":POKE $9FB3,0
 void
 emu_write(uint8_t reg, uint8_t value)
@@ -236,6 +240,7 @@ emu_write(uint8_t reg, uint8_t value)
 		case 3: echo_mode = value; break;
 		case 4: save_on_exit = v; break;
 		case 5: emu_recorder_set((gif_recorder_command_t) value); break;
+		case 6: meter_select = value & 0x0f; audio_enable_meters(true); break;
 		case 15: led_status = v; break;
 		default: printf("WARN: Invalid register %x\n", DEVICE_EMULATOR + reg);
 	}
@@ -256,6 +261,14 @@ emu_read(uint8_t reg, bool debugOn)
 		return save_on_exit ? 1 : 0;
 	} else if (reg == 5) {
 		return record_gif;
+	} else if (reg == 6) {
+		return meter_select;
+	} else if (reg == 7) {
+		struct audio_meter meter;
+		audio_get_meter(meter_select & 3, &meter);
+		const int c = (meter_select >> 2) & 1;
+		const int level = ((meter_select & 8) ? meter.rms[c] : meter.peak[c]) >> 7;
+		return level > 255 ? 255 : level;
 
 	} else if (reg == 8) {
 		return (clockticks6502 >> 0) & 0xff;
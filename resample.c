@@ -0,0 +1,157 @@
+// Commander X16 Emulator
+// Copyright (c) 2020 Frank van den Hoef
+// All rights reserved. License: 2-clause BSD
+
+// Polyphase windowed-sinc resampler from the VERA sample rate to the rate
+// of the audio device. The ratio can be nudged a little while running, to
+// keep the playback buffer at its target fill level.
+
+#include "resample.h"
+
+#include <math.h>
+#include <string.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define TAPS   32  // filter length in input samples
+#define PHASES 256 // filter tables per input sample, interpolated in between
+
+// input samples buffered at once, beyond the filter history
+#define MAX_INPUT 2048
+#define HIST_SIZE (2 * TAPS + MAX_INPUT)
+
+// independent partial sums, so the dot products vectorize without
+// reassociating floating point additions
+#define LANES 8
+
+// the largest ratio adjustment, in either direction
+#define MAX_ADJUST 0.005
+
+static float    coefs[PHASES + 1][TAPS];
+static float    hist_l[HIST_SIZE];
+static float    hist_r[HIST_SIZE];
+static unsigned hist_count;
+static double   pos;       // of the next output sample, in input samples from hist_l[0]
+static double   base_step; // input samples per output sample
+static double   step;
+
+static double
+window(double x)
+{
+	// Blackman
+	const double t = M_PI * x / (TAPS / 2);
+	return 0.42 + 0.5 * cos(t) + 0.08 * cos(2 * t);
+}
+
+void
+resample_init(int in_rate, int out_rate)
+{
+	// cut off a little below the lower of the two Nyquist frequencies,
+	// in cycles per input sample
+	const double cutoff = 0.5 * 0.9 * (out_rate < in_rate ? (double)out_rate / in_rate : 1.0);
+
+	for (int p = 0; p <= PHASES; p++) {
+		double sum = 0;
+		for (int k = 0; k < TAPS; k++) {
+			const double x = k - (TAPS / 2 - 1) - (double)p / PHASES;
+			const double sinc = x == 0 ? 1.0 : sin(2 * M_PI * cutoff * x) / (2 * M_PI * cutoff * x);
+			coefs[p][k] = sinc * window(x);
+			sum += coefs[p][k];
+		}
+		// unity gain at DC for every phase
+		for (int k = 0; k < TAPS; k++) {
+			coefs[p][k] /= sum;
+		}
+	}
+
+	memset(hist_l, 0, sizeof(hist_l));
+	memset(hist_r, 0, sizeof(hist_r));
+	hist_count = TAPS;
+	pos        = 0;
+	base_step  = (double)in_rate / out_rate;
+	step       = base_step;
+}
+
+// Play slightly faster (adjust > 0, fewer output samples) or slower. The
+// adjustment is clamped to -1..1, i.e. MAX_ADJUST in either direction.
+void
+resample_set_adjust(double adjust)
+{
+	if (adjust > 1) {
+		adjust = 1;
+	}
+	if (adjust < -1) {
+		adjust = -1;
+	}
+	step = base_step * (1 + adjust * MAX_ADJUST);
+}
+
+unsigned
+resample_max_output(unsigned in_count)
+{
+	return (unsigned)(in_count / (base_step * (1 - MAX_ADJUST))) + 2;
+}
+
+// Resample stereo samples; returns the number of samples written to out,
+// at most resample_max_output(in_count).
+unsigned
+resample_process(const int16_t *in, unsigned in_count, int16_t *out)
+{
+	unsigned out_count = 0;
+
+	while (in_count > 0) {
+		const unsigned n = in_count < MAX_INPUT ? in_count : MAX_INPUT;
+		for (unsigned i = 0; i < n; i++) {
+			hist_l[hist_count + i] = in[i * 2];
+			hist_r[hist_count + i] = in[i * 2 + 1];
+		}
+		hist_count += n;
+		in += n * 2;
+		in_count -= n;
+
+		while (pos + TAPS <= hist_count) {
+			const unsigned base  = (unsigned)pos;
+			const double   phase = (pos - base) * PHASES;
+			const unsigned p     = (unsigned)phase;
+			const float    t     = phase - p;
+			const float *  c0    = coefs[p];
+			const float *  c1    = coefs[p + 1];
+			const float *  l     = &hist_l[base];
+			const float *  r     = &hist_r[base];
+
+			float acc_l[LANES] = { 0 };
+			float acc_r[LANES] = { 0 };
+			for (int k = 0; k < TAPS; k += LANES) {
+				for (int j = 0; j < LANES; j++) {
+					const float c = c0[k + j] + (c1[k + j] - c0[k + j]) * t;
+					acc_l[j] += l[k + j] * c;
+					acc_r[j] += r[k + j] * c;
+				}
+			}
+			float sum_l = 0;
+			float sum_r = 0;
+			for (int j = 0; j < LANES; j++) {
+				sum_l += acc_l[j];
+				sum_r += acc_r[j];
+			}
+
+			sum_l = sum_l > 32767 ? 32767 : sum_l < -32768 ? -32768 : sum_l;
+			sum_r = sum_r > 32767 ? 32767 : sum_r < -32768 ? -32768 : sum_r;
+			out[out_count * 2]     = lrintf(sum_l);
+			out[out_count * 2 + 1] = lrintf(sum_r);
+			out_count++;
+			pos += step;
+		}
+
+		// keep the history the next output sample needs
+		const unsigned consumed = (unsigned)pos;
+		memmove(hist_l, &hist_l[consumed], (hist_count - consumed) * sizeof(hist_l[0]));
+		memmove(hist_r, &hist_r[consumed], (hist_count - consumed) * sizeof(hist_r[0]));
+		hist_count -= consumed;
+		pos -= consumed;
+	}
+
+	return out_count;
+}
@@ -0,0 +1,12 @@
+// Commander X16 Emulator
+// Copyright (c) 2020 Frank van den Hoef
+// All rights reserved. License: 2-clause BSD
+
+#pragma once
+
+#include <stdint.h>
+
+void     resample_init(int in_rate, int out_rate);
+void     resample_set_adjust(double adjust);
+unsigned resample_max_output(unsigned in_count);
+unsigned resample_process(const int16_t *in, unsigned in_count, int16_t *out);
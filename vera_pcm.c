@@ -101,41 +101,93 @@ pcm_is_fifo_almost_empty(void)
 	return fifo_cnt < 1024;
 }
 
+// Read the next sample from the FIFO
+static void
+read_sample(void)
+{
+	switch ((ctrl >> 4) & 3) {
+		case 0: { // mono 8-bit
+			cur_l = (int16_t)read_fifo() << 8;
+			cur_r = cur_l;
+			break;
+		}
+		case 1: { // stereo 8-bit
+			cur_l = read_fifo() << 8;
+			cur_r = read_fifo() << 8;
+			break;
+		}
+		case 2: { // mono 16-bit
+			cur_l = read_fifo();
+			cur_l |= read_fifo() << 8;
+			cur_r = cur_l;
+			break;
+		}
+		case 3: { // stereo 16-bit
+			cur_l = read_fifo();
+			cur_l |= read_fifo() << 8;
+			cur_r = read_fifo();
+			cur_r |= read_fifo() << 8;
+			break;
+		}
+	}
+}
+
+// Number of samples until the next one that reads from the FIFO, counting
+// that one, or 0 if no sample reads from it anymore.
+unsigned
+pcm_samples_until_read(void)
+{
+	if (rate == 0) {
+		return 0;
+	}
+	if (rate <= 128) {
+		// bit 7 of the phase flips on every multiple of 128 it passes
+		return (128 - (phase & 127) + rate - 1) / rate;
+	}
+	// passing two multiples of 128 in one sample leaves bit 7 unchanged
+	uint8_t p = phase;
+	for (unsigned i = 1; i <= 256; i++) {
+		const uint8_t old_p = p;
+		p += rate;
+		if ((old_p & 0x80) != (p & 0x80)) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+// Advance by the given number of samples. Without a buffer, only the FIFO
+// and the current sample are kept up to date.
 void
 pcm_render(int16_t *buf, unsigned num_samples)
 {
+	if (!buf && rate <= 128) {
+		// skip all but the last sample read
+		const unsigned reads = ((phase & 0xFF) + num_samples * rate) / 128 - (phase & 0xFF) / 128;
+		phase += num_samples * rate;
+		if (reads > 0) {
+			static const unsigned bytes_per_sample[4] = { 1, 2, 2, 4 };
+			unsigned skip = (reads - 1) * bytes_per_sample[(ctrl >> 4) & 3];
+			if (skip > fifo_cnt) {
+				skip = fifo_cnt;
+			}
+			fifo_rdidx = (fifo_rdidx + skip) % sizeof(fifo);
+			fifo_cnt -= skip;
+			read_sample();
+		}
+		return;
+	}
+
 	while (num_samples--) {
 		uint8_t old_phase = phase;
 		phase += rate;
 		if ((old_phase & 0x80) != (phase & 0x80)) {
-			switch ((ctrl >> 4) & 3) {
-				case 0: { // mono 8-bit
-					cur_l = (int16_t)read_fifo() << 8;
-					cur_r = cur_l;
-					break;
-				}
-				case 1: { // stereo 8-bit
-					cur_l = read_fifo() << 8;
-					cur_r = read_fifo() << 8;
-					break;
-				}
-				case 2: { // mono 16-bit
-					cur_l = read_fifo();
-					cur_l |= read_fifo() << 8;
-					cur_r = cur_l;
-					break;
-				}
-				case 3: { // stereo 16-bit
-					cur_l = read_fifo();
-					cur_l |= read_fifo() << 8;
-					cur_r = read_fifo();
-					cur_r |= read_fifo() << 8;
-					break;
-				}
-			}
+			read_sample();
 		}
 
-		*(buf++) = ((int)cur_l * (int)volume_lut[ctrl & 0xF]) >> 6;
-		*(buf++) = ((int)cur_r * (int)volume_lut[ctrl & 0xF]) >> 6;
+		if (buf) {
+			*(buf++) = ((int)cur_l * (int)volume_lut[ctrl & 0xF]) >> 6;
+			*(buf++) = ((int)cur_r * (int)volume_lut[ctrl & 0xF]) >> 6;
+		}
 	}
 }
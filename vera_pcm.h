@@ -14,4 +14,5 @@ void    pcm_write_rate(uint8_t val);
 uint8_t pcm_read_rate(void);
 void    pcm_write_fifo(uint8_t val);
 void    pcm_render(int16_t *buf, unsigned num_samples);
+unsigned pcm_samples_until_read(void);
 bool    pcm_is_fifo_almost_empty(void);
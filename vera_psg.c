@@ -5,9 +5,13 @@
 #include "vera_psg.h"
 
 #include <stdbool.h>
-#include <stdlib.h>
 #include <string.h>
 
+#define NUM_CHANNELS 16
+
+// samples rendered at once; the unmasked phase after a chunk must fit into 32 bits
+#define CHUNK_SIZE 256
+
 enum waveform {
 	WF_PULSE = 0,
 	WF_SAWTOOTH,
@@ -15,25 +19,35 @@ enum waveform {
 	WF_NOISE,
 };
 
-struct channel {
-	uint16_t freq;
-	uint8_t  volume;
-	bool     left, right;
-	uint8_t  pw;
-	uint8_t  waveform;
-
-	unsigned phase;
-	uint8_t  noiseval;
-};
-
-static struct channel channels[16];
+// The channels are kept as a structure of arrays, and rendered one channel
+// at a time over a chunk of samples. The phase of every sample follows
+// from the phase at the start of the chunk, so the loops of the periodic
+// waveforms have no dependencies between samples and can be vectorized.
+static struct {
+	uint32_t freq[NUM_CHANNELS];
+	uint32_t phase[NUM_CHANNELS];
+	int32_t  volume[NUM_CHANNELS];
+	bool     left[NUM_CHANNELS];
+	bool     right[NUM_CHANNELS];
+	uint32_t pw[NUM_CHANNELS];
+	uint8_t  waveform[NUM_CHANNELS];
+	uint8_t  noiseval[NUM_CHANNELS];
+} channels;
+
+// Like VERA, all channels share one noise generator: a 16 bit LFSR that
+// shifts one bit per sample into a 6 bit value. A channel latches the
+// value whenever its phase wraps.
+static uint16_t noise_state = 1;
+static uint8_t  noise_out;
 
 static uint8_t volume_lut[64] = {0, 1, 1, 1, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 6, 6, 7, 7, 7, 8, 8, 9, 9, 10, 11, 11, 12, 13, 14, 14, 15, 16, 17, 18, 19, 21, 22, 23, 25, 26, 28, 29, 31, 33, 35, 37, 39, 42, 44, 47, 50, 52, 56, 59, 63};
 
 void
 psg_reset(void)
 {
-	memset(channels, 0, sizeof(channels));
+	memset(&channels, 0, sizeof(channels));
+	noise_state = 1;
+	noise_out   = 0;
 }
 
 void
@@ -45,68 +59,132 @@ psg_writereg(uint8_t reg, uint8_t val)
 	int idx = reg & 3;
 
 	switch (idx) {
-		case 0: channels[ch].freq = (channels[ch].freq & 0xFF00) | val; break;
-		case 1: channels[ch].freq = (channels[ch].freq & 0x00FF) | (val << 8); break;
+		case 0: channels.freq[ch] = (channels.freq[ch] & 0xFF00) | val; break;
+		case 1: channels.freq[ch] = (channels.freq[ch] & 0x00FF) | (val << 8); break;
 		case 2: {
-			channels[ch].right  = (val & 0x80) != 0;
-			channels[ch].left   = (val & 0x40) != 0;
-			channels[ch].volume = volume_lut[val & 0x3F];
+			channels.right[ch]  = (val & 0x80) != 0;
+			channels.left[ch]   = (val & 0x40) != 0;
+			channels.volume[ch] = volume_lut[val & 0x3F];
 			break;
 		}
 		case 3: {
-			channels[ch].pw       = val & 0x3F;
-			channels[ch].waveform = val >> 6;
+			channels.pw[ch]       = val & 0x3F;
+			channels.waveform[ch] = val >> 6;
 			break;
 		}
 	}
 }
 
+// Latch the noise value of the last phase wrap in the chunk, if any. The
+// phase after sample i is phase + (i + 1) * freq.
 static void
-render(int16_t *left, int16_t *right)
+latch_noise(int ch, const uint8_t *noise, unsigned num_samples)
 {
-	int l = 0;
-	int r = 0;
-
-	for (int i = 0; i < 16; i++) {
-		struct channel *ch = &channels[i];
+	const uint32_t phase = channels.phase[ch];
+	const uint32_t freq  = channels.freq[ch];
+	const uint32_t wrap  = (phase + num_samples * freq) & ~0xFFFF;
+	if (wrap > (phase & ~0xFFFF)) {
+		channels.noiseval[ch] = noise[(wrap - phase + freq - 1) / freq - 1];
+	}
+}
 
-		unsigned new_phase = (ch->phase + ch->freq) & 0x1FFFF;
-		if ((ch->phase & 0x10000) != (new_phase & 0x10000)) {
-			ch->noiseval = rand() & 63;
-		}
-		ch->phase = new_phase;
-
-		uint8_t v = 0;
-		switch (ch->waveform) {
-			case WF_PULSE: v = (ch->phase >> 10) > ch->pw ? 0 : 63; break;
-			case WF_SAWTOOTH: v = ch->phase >> 11; break;
-			case WF_TRIANGLE: v = (ch->phase & 0x10000) ? (~(ch->phase >> 10) & 0x3F) : ((ch->phase >> 10) & 0x3F); break;
-			case WF_NOISE: v = ch->noiseval; break;
-		}
-		int8_t sv = (v ^ 0x20);
-		if (sv & 0x20) {
-			sv |= 0xC0;
+static void
+render_channel(int ch, int32_t *left, int32_t *right, const uint8_t *noise, unsigned num_samples)
+{
+	const uint32_t phase  = channels.phase[ch];
+	const uint32_t freq   = channels.freq[ch];
+	const uint32_t pw     = channels.pw[ch];
+	const int32_t  volume = channels.volume[ch];
+	const int32_t  lmask  = channels.left[ch] ? -1 : 0;
+	const int32_t  rmask  = channels.right[ch] ? -1 : 0;
+
+	// the 6 bit waveform values are centered around 0 before the volume applies
+	switch (channels.waveform[ch]) {
+		case WF_PULSE:
+			for (unsigned i = 0; i < num_samples; i++) {
+				const uint32_t p = (phase + (i + 1) * freq) & 0x1FFFF;
+				const int32_t  v = (((p >> 10) > pw ? 0 : 63) - 32) * volume;
+				left[i] += v & lmask;
+				right[i] += v & rmask;
+			}
+			break;
+		case WF_SAWTOOTH:
+			for (unsigned i = 0; i < num_samples; i++) {
+				const uint32_t p = (phase + (i + 1) * freq) & 0x1FFFF;
+				const int32_t  v = ((int32_t)(p >> 11) - 32) * volume;
+				left[i] += v & lmask;
+				right[i] += v & rmask;
+			}
+			break;
+		case WF_TRIANGLE:
+			for (unsigned i = 0; i < num_samples; i++) {
+				const uint32_t p = (phase + (i + 1) * freq) & 0x1FFFF;
+				const uint32_t t = (p & 0x10000) ? ~(p >> 10) : (p >> 10);
+				const int32_t  v = ((int32_t)(t & 0x3F) - 32) * volume;
+				left[i] += v & lmask;
+				right[i] += v & rmask;
+			}
+			break;
+		case WF_NOISE: {
+			uint32_t p        = phase;
+			uint8_t  noiseval = channels.noiseval[ch];
+			for (unsigned i = 0; i < num_samples; i++) {
+				const uint32_t new_p = (p + freq) & 0x1FFFF;
+				if ((p ^ new_p) & 0x10000) {
+					noiseval = noise[i];
+				}
+				p = new_p;
+				const int32_t v = ((int32_t)noiseval - 32) * volume;
+				left[i] += v & lmask;
+				right[i] += v & rmask;
+			}
+			channels.noiseval[ch] = noiseval;
+			break;
 		}
+	}
+}
 
-		int val = (int)sv * (int)ch->volume;
+static void
+render_chunk(int16_t *buf, unsigned num_samples)
+{
+	int32_t left[CHUNK_SIZE];
+	int32_t right[CHUNK_SIZE];
+	uint8_t noise[CHUNK_SIZE];
+
+	for (unsigned i = 0; i < num_samples; i++) {
+		noise[i]    = noise_out;
+		noise_state = (noise_state << 1) | (((noise_state >> 1) ^ (noise_state >> 2) ^ (noise_state >> 4) ^ (noise_state >> 15)) & 1);
+		noise_out   = ((noise_out << 1) | (noise_state & 1)) & 63;
+	}
 
-		if (ch->left) {
-			l += val;
+	memset(left, 0, num_samples * sizeof(left[0]));
+	memset(right, 0, num_samples * sizeof(right[0]));
+
+	for (int ch = 0; ch < NUM_CHANNELS; ch++) {
+		const bool silent = channels.volume[ch] == 0 || (!channels.left[ch] && !channels.right[ch]);
+		if (!silent) {
+			render_channel(ch, left, right, noise, num_samples);
 		}
-		if (ch->right) {
-			r += val;
+		// silent channels keep running, but only their phase and noise value
+		if (silent || channels.waveform[ch] != WF_NOISE) {
+			latch_noise(ch, noise, num_samples);
 		}
+		channels.phase[ch] = (channels.phase[ch] + num_samples * channels.freq[ch]) & 0x1FFFF;
 	}
 
-	*left  = l;
-	*right = r;
+	for (unsigned i = 0; i < num_samples; i++) {
+		buf[i * 2]     = left[i];
+		buf[i * 2 + 1] = right[i];
+	}
 }
 
 void
 psg_render(int16_t *buf, unsigned num_samples)
 {
-	while (num_samples--) {
-		render(&buf[0], &buf[1]);
-		buf += 2;
+	while (num_samples > 0) {
+		const unsigned n = num_samples < CHUNK_SIZE ? num_samples : CHUNK_SIZE;
+		render_chunk(buf, n);
+		buf += n * 2;
+		num_samples -= n;
 	}
 }
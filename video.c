@@ -11,7 +11,7 @@
 #include "keyboard.h"
 #include "gif.h"
 #include "vera_spi.h"
-#include "vera_psg.h"
+#include "audio.h"
 #include "vera_pcm.h"
 #include "icon.h"
 #include "sdcard.h"
@@ -42,13 +42,13 @@
 #define VGA_FRONT_PORCH_X 16
 #define	VGA_BACK_PORCH_Y 33
 #define VGA_FRONT_PORCH_Y 10
-#define VGA_PIXEL_FREQ 25.175
+#define VGA_PIXEL_FREQ_KHZ 25175
 
 // NTSC: 262.5 lines per frame, lower field first
 #define NTSC_FRONT_PORCH_X 80
 #define NTSC_BACK_PORCH_Y 23
 #define NTSC_FRONT_PORCH_Y 7
-#define NTSC_PIXEL_FREQ (15.750 * 800 / 1000)
+#define NTSC_PIXEL_FREQ_KHZ (15750 * 800 / 1000)
 #define TITLE_SAFE_X 0.067
 #define TITLE_SAFE_Y 0.05
 
@@ -56,6 +56,10 @@
 #define SCREEN_WIDTH 640
 #define SCREEN_HEIGHT 480
 
+// frames at 2:1 scale are rendered at half the resolution
+#define HALF_WIDTH (SCREEN_WIDTH / 2)
+#define HALF_HEIGHT (SCREEN_HEIGHT / 2)
+
 #define SCREEN_RAM_OFFSET 0x00000
 
 #ifdef __APPLE__
@@ -69,13 +73,39 @@
 // When rendering a layer line, we can amortize some of the cost by calculating multiple pixels at a time.
 #define LAYER_PIXELS_PER_ITERATION 8
 
+// VRAM write tracking granularity: fine blocks for map and bitmap lines,
+// coarse areas for tile data
+#define VRAM_BLOCK_SHIFT 8
+#define VRAM_AREA_SHIFT 13
+
+// Commands from the CPU thread to the render thread, a power of 2
+#define RENDER_QUEUE_SIZE (1 << 20)
+
+// Input events waiting for the emulation thread
+#define INPUT_QUEUE_SIZE 256
+
+// flag in present_ready: the ready frame hasn't been presented yet
+#define PRESENT_FRESH 4
+
+// Frames waiting for the GIF encoder
+#define GIF_QUEUE_SIZE 4
+#define GIF_COLOR_HASH_BITS 10
+#define GIF_COLOR_HASH_SIZE (1 << GIF_COLOR_HASH_BITS)
+
 
 static SDL_Window *window;
 static SDL_Renderer *renderer;
 static SDL_Texture *sdlTexture;
+static SDL_Texture *sdlTextureHalf;
+static SDL_Texture *present_texture; // the texture last uploaded to
+// pixel format of sdlTexture, palette entries are converted to it
+static SDL_PixelFormat *texture_format;
 static bool is_fullscreen = false;
 
+// VRAM as seen by the CPU
 static uint8_t video_ram[0x20000];
+// VRAM as seen by the renderer: video_ram, or a copy owned by the render thread
+static uint8_t *render_ram = video_ram;
 static uint8_t palette[256 * 2];
 static uint8_t sprite_data[128][8];
 
@@ -91,6 +121,10 @@ static uint8_t isr;
 
 static uint16_t irq_line;
 
+static uint8_t io_reg_layer[2][7];
+static uint8_t io_reg_composer[8];
+
+// Layer and composer registers as seen by the renderer
 static uint8_t reg_layer[2][7];
 static uint8_t reg_composer[8];
 
@@ -102,14 +136,138 @@ static uint8_t sprite_line_collisions;
 static bool layer_line_enable[2];
 static bool sprite_line_enable;
 
-float scan_pos_x;
+// horizontal beam position in 1/(CPU kHz) pixels, so that a CPU clock
+// advances it by exactly the pixel clock in kHz
+uint32_t scan_pos_x;
 uint16_t scan_pos_y;
 int frame_count = 0;
 
+// Frame skipping: the layers of a skipped frame are neither rendered nor
+// presented. Sprites are still evaluated for the collision IRQ.
+static bool skip_layers;
+static bool last_frame_skipped;
+
 static uint8_t framebuffer[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
 
+// Change detection: a line is only rendered again if the hash of its
+// inputs differs from the one it was last rendered with.
+static uint64_t line_hash[SCREEN_HEIGHT]; // 0 = invalid
+
+// Frame serial each framebuffer line last changed in, so only changed
+// lines have to be copied and uploaded.
+static uint32_t present_serial = 1;
+static uint32_t line_frame[SCREEN_HEIGHT];
+static uint32_t texture_frame; // serial of the frame in present_texture
+
+// If every line of a frame is scaled 2:1 and each odd line repeats the
+// even line above it, the next frame is rendered as 320x240: line pair y
+// goes into framebuffer row y / 2 of HALF_WIDTH pixels, and SDL scales
+// it up. A frame that turns out not to fit is converted back to 640x480
+// at the first line that doesn't.
+static bool frame_half;
+static bool half_compatible;
+
+// 64 bits, so the latest write is always the largest generation
+static uint64_t vram_write_gen;
+static uint64_t vram_block_gen[0x20000 >> VRAM_BLOCK_SHIFT];
+static uint64_t vram_area_gen[0x20000 >> VRAM_AREA_SHIFT];
+static uint32_t palette_gen;
+
+// 1bpp byte -> 8 byte masks (0xff for set pixels), for rendering text
+static uint8_t text_mask_lut[256][8];
+
+// layer x for every layer x, for composing unscaled pixels
+static int identity_eff_x[SCREEN_WIDTH];
+
 static GifWriter gif_writer;
 
+// GIF encoder thread, fed with frames through a bounded queue
+struct gif_queue_entry {
+	uint32_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT]; // 0x00RRGGBB
+	uint32_t delay; // 1/100 s, 0 = stop
+};
+
+static SDL_Thread *gif_thread;
+static struct gif_queue_entry *gif_queue;
+static int gif_queue_wridx; // emulation thread only
+static int gif_queue_rdidx; // encoder thread only
+static SDL_sem *gif_queue_free_sem;
+static SDL_sem *gif_queue_full_sem;
+static SDL_atomic_t gif_failed;
+
+// raw video capture
+static FILE *capture_file;
+static bool capture_indexed;
+static uint8_t *capture_indices; // color index per pixel, written by render_line
+static uint8_t *capture_planes;  // Y, U and V
+static uint32_t capture_palette[256];
+
+// GIF encoder thread only
+static uint32_t *gif_old_pixels;
+static uint32_t gif_color_keys[GIF_COLOR_HASH_SIZE];
+static uint8_t gif_color_indices[GIF_COLOR_HASH_SIZE];
+
+// Render thread: the CPU thread queues all writes that affect rendering
+// in order, interleaved with the lines to render, and the render thread
+// replays them. This keeps mid-frame (raster) effects line-accurate.
+enum render_command {
+	RENDER_CMD_VRAM_WRITE,
+	RENDER_CMD_COMPOSER_WRITE,
+	RENDER_CMD_LAYER_WRITE,
+	RENDER_CMD_LINE,
+	RENDER_CMD_CLEAR_COLLISIONS,
+	RENDER_CMD_SYNC,
+	RENDER_CMD_QUIT,
+};
+
+static SDL_Thread *render_thread;
+static uint32_t render_queue[RENDER_QUEUE_SIZE];
+static uint32_t render_queue_wridx;        // CPU thread only
+static uint32_t render_queue_rdidx_cached; // CPU thread only
+static SDL_atomic_t render_queue_published_wridx;
+static SDL_atomic_t render_queue_rdidx;
+static SDL_sem *render_queue_sem;
+static SDL_sem *render_sync_sem;
+
+// Presentation thread: the emulation thread hands finished frames to the
+// thread that owns the renderer through a triple buffer, and that thread
+// queues input events back.
+struct video_frame {
+	uint8_t pixels[SCREEN_WIDTH * SCREEN_HEIGHT * 4];
+	uint32_t line_frame[SCREEN_HEIGHT];
+	uint32_t serial;
+	bool half;
+};
+
+static bool present_threaded;
+static struct video_frame present_frames[3];
+static int present_back = 0;            // emulation thread only
+static int present_front = 2;           // presentation thread only
+static SDL_atomic_t present_ready = {1}; // slot index | PRESENT_FRESH
+static SDL_atomic_t present_quit;
+
+enum input_event_type {
+	INPUT_EVENT_SDL,
+	INPUT_EVENT_DUMP,
+	INPUT_EVENT_RESET,
+	INPUT_EVENT_PASTE,
+	INPUT_EVENT_TOGGLE_WARP,
+	INPUT_EVENT_SDCARD_ATTACH,
+	INPUT_EVENT_SDCARD_DETACH,
+};
+
+struct input_event {
+	uint8_t type;
+	SDL_Event event;
+	char *text;
+};
+
+static SDL_mutex *input_mutex;
+static struct input_event input_queue[INPUT_QUEUE_SIZE];
+static int input_queue_count;
+static char pending_title[64];
+static bool title_pending;
+
 static const uint16_t default_palette[] = {
 0x000,0xfff,0x800,0xafe,0xc4c,0x0c5,0x00a,0xee7,0xd85,0x640,0xf77,0x333,0x777,0xaf6,0x08f,0xbbb,0x000,0x111,0x222,0x333,0x444,0x555,0x666,0x777,0x888,0x999,0xaaa,0xbbb,0xccc,0xddd,0xeee,0xfff,0x211,0x433,0x644,0x866,0xa88,0xc99,0xfbb,0x211,0x422,0x633,0x844,0xa55,0xc66,0xf77,0x200,0x411,0x611,0x822,0xa22,0xc33,0xf33,0x200,0x400,0x600,0x800,0xa00,0xc00,0xf00,0x221,0x443,0x664,0x886,0xaa8,0xcc9,0xfeb,0x211,0x432,0x653,0x874,0xa95,0xcb6,0xfd7,0x210,0x431,0x651,0x862,0xa82,0xca3,0xfc3,0x210,0x430,0x640,0x860,0xa80,0xc90,0xfb0,0x121,0x343,0x564,0x786,0x9a8,0xbc9,0xdfb,0x121,0x342,0x463,0x684,0x8a5,0x9c6,0xbf7,0x120,0x241,0x461,0x582,0x6a2,0x8c3,0x9f3,0x120,0x240,0x360,0x480,0x5a0,0x6c0,0x7f0,0x121,0x343,0x465,0x686,0x8a8,0x9ca,0xbfc,0x121,0x242,0x364,0x485,0x5a6,0x6c8,0x7f9,0x020,0x141,0x162,0x283,0x2a4,0x3c5,0x3f6,0x020,0x041,0x061,0x082,0x0a2,0x0c3,0x0f3,0x122,0x344,0x466,0x688,0x8aa,0x9cc,0xbff,0x122,0x244,0x366,0x488,0x5aa,0x6cc,0x7ff,0x022,0x144,0x166,0x288,0x2aa,0x3cc,0x3ff,0x022,0x044,0x066,0x088,0x0aa,0x0cc,0x0ff,0x112,0x334,0x456,0x668,0x88a,0x9ac,0xbcf,0x112,0x224,0x346,0x458,0x56a,0x68c,0x79f,0x002,0x114,0x126,0x238,0x24a,0x35c,0x36f,0x002,0x014,0x016,0x028,0x02a,0x03c,0x03f,0x112,0x334,0x546,0x768,0x98a,0xb9c,0xdbf,0x112,0x324,0x436,0x648,0x85a,0x96c,0xb7f,0x102,0x214,0x416,0x528,0x62a,0x83c,0x93f,0x102,0x204,0x306,0x408,0x50a,0x60c,0x70f,0x212,0x434,0x646,0x868,0xa8a,0xc9c,0xfbe,0x211,0x423,0x635,0x847,0xa59,0xc6b,0xf7d,0x201,0x413,0x615,0x826,0xa28,0xc3a,0xf3c,0x201,0x403,0x604,0x806,0xa08,0xc09,0xf0b
 };
@@ -117,11 +275,19 @@ static const uint16_t default_palette[] = {
 uint8_t video_space_read(uint32_t address);
 static void video_space_read_range(uint8_t* dest, uint32_t address, uint32_t size);
 
+static void mark_palette_dirty(uint16_t begin, uint16_t end);
 static void refresh_palette();
+static void refresh_composer_properties();
+static void refresh_layer_properties(const uint8_t layer);
+static void render_command(uint8_t command, uint32_t address, uint8_t value);
+static void video_sync_render();
 
 void
 video_reset()
 {
+	// the render thread must be idle while its state is reset
+	video_sync_render();
+
 	// init I/O registers
 	memset(io_addr, 0, sizeof(io_addr));
 	memset(io_inc, 0, sizeof(io_inc));
@@ -135,14 +301,21 @@ video_reset()
 	irq_line = 0;
 
 	// init Layer registers
-	memset(reg_layer, 0, sizeof(reg_layer));
+	memset(io_reg_layer, 0, sizeof(io_reg_layer));
+	memcpy(reg_layer, io_reg_layer, sizeof(reg_layer));
+
+	refresh_layer_properties(0);
+	refresh_layer_properties(1);
 
 	// init composer registers
-	memset(reg_composer, 0, sizeof(reg_composer));
-	reg_composer[1] = 128; // hscale = 1.0
-	reg_composer[2] = 128; // vscale = 1.0
-	reg_composer[5] = 640 >> 2;
-	reg_composer[7] = 480 >> 1;
+	memset(io_reg_composer, 0, sizeof(io_reg_composer));
+	io_reg_composer[1] = 128; // hscale = 1.0
+	io_reg_composer[2] = 128; // vscale = 1.0
+	io_reg_composer[5] = 640 >> 2;
+	io_reg_composer[7] = 480 >> 1;
+	memcpy(reg_composer, io_reg_composer, sizeof(reg_composer));
+
+	refresh_composer_properties();
 
 	// init sprite data
 	memset(sprite_data, 0, sizeof(sprite_data));
@@ -154,24 +327,45 @@ video_reset()
 		palette[i * 2 + 1] = default_palette[i] >> 8;
 	}
 
+	mark_palette_dirty(0, 256);
 	refresh_palette();
 
+	for (int x = 0; x < SCREEN_WIDTH; x++) {
+		identity_eff_x[x] = x;
+	}
+
+	for (int i = 0; i < 256; i++) {
+		for (int b = 0; b < 8; b++) {
+			text_mask_lut[i][b] = ((i << b) & 0x80) ? 0xff : 0x00;
+		}
+	}
+
 	// fill video RAM with random data
 	for (int i = 0; i < 128 * 1024; i++) {
 		video_ram[i] = rand();
 	}
+	if (render_ram != video_ram) {
+		memcpy(render_ram, video_ram, sizeof(video_ram));
+	}
 
 	sprite_line_collisions = 0;
 
+	// render and upload everything on the next frame
+	memset(line_hash, 0, sizeof(line_hash));
+
 	scan_pos_x = 0;
 	scan_pos_y = 0;
 
-	psg_reset();
+	audio_reset_psg();
 	pcm_reset();
 }
 
+static int render_thread_main(void *data);
+static int gif_thread_main(void *data);
+static bool video_capture_begin(const char *path);
+
 bool
-video_init(int window_scale, char *quality)
+video_init(int window_scale, char *quality, bool use_render_thread, bool use_present_thread)
 {
 	uint32_t window_flags = SDL_WINDOW_ALLOW_HIGHDPI;
 
@@ -182,17 +376,49 @@ video_init(int window_scale, char *quality)
 
 	video_reset();
 
+	// the debugger draws and polls events from the emulation thread
+#ifndef __EMSCRIPTEN__
+	present_threaded = use_present_thread && !debugger_enabled;
+#endif
+	input_mutex = SDL_CreateMutex();
+
 	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, quality);
+	if (present_threaded) {
+		// waiting for vsync no longer holds up emulation
+		SDL_SetHint(SDL_HINT_RENDER_VSYNC, "1");
+	}
 	SDL_CreateWindowAndRenderer(SCREEN_WIDTH * window_scale, SCREEN_HEIGHT * window_scale, window_flags, &window, &renderer);
 #ifndef __MORPHOS__
 	SDL_SetWindowResizable(window, true);
 #endif
 	SDL_RenderSetLogicalSize(renderer, SCREEN_WIDTH, SCREEN_HEIGHT);
 
+	// use the renderer's preferred 32 bit format, so that uploading
+	// doesn't have to convert
+	uint32_t pixel_format = SDL_PIXELFORMAT_RGB888;
+	SDL_RendererInfo info;
+	if (!SDL_GetRendererInfo(renderer, &info)) {
+		for (int i = 0; i < info.num_texture_formats; i++) {
+			uint32_t format = info.texture_formats[i];
+			if (!SDL_ISPIXELFORMAT_FOURCC(format) && !SDL_ISPIXELFORMAT_INDEXED(format) && SDL_BITSPERPIXEL(format) >= 24 && SDL_BYTESPERPIXEL(format) == 4) {
+				pixel_format = format;
+				break;
+			}
+		}
+	}
+	texture_format = SDL_AllocFormat(pixel_format);
+	mark_palette_dirty(0, 256);
+	refresh_palette();
+
 	sdlTexture = SDL_CreateTexture(renderer,
-									SDL_PIXELFORMAT_RGB888,
+									pixel_format,
 									SDL_TEXTUREACCESS_STREAMING,
 									SCREEN_WIDTH, SCREEN_HEIGHT);
+	sdlTextureHalf = SDL_CreateTexture(renderer,
+									pixel_format,
+									SDL_TEXTUREACCESS_STREAMING,
+									HALF_WIDTH, HALF_HEIGHT);
+	present_texture = sdlTexture;
 
 	SDL_SetWindowTitle(window, "Commander X16");
 	SDL_SetWindowIcon(window, CommanderX16Icon());
@@ -209,15 +435,46 @@ video_init(int window_scale, char *quality)
 			// start now
 			record_gif = RECORD_GIF_ACTIVE;
 		}
-		if (!GifBegin(&gif_writer, gif_path, SCREEN_WIDTH, SCREEN_HEIGHT, 1, 8, false)) {
+		if (GifBegin(&gif_writer, gif_path, SCREEN_WIDTH, SCREEN_HEIGHT, 1, 8, false)) {
+			gif_queue = malloc(GIF_QUEUE_SIZE * sizeof(*gif_queue));
+			gif_old_pixels = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+			gif_queue_free_sem = SDL_CreateSemaphore(GIF_QUEUE_SIZE);
+			gif_queue_full_sem = SDL_CreateSemaphore(0);
+			gif_thread = SDL_CreateThread(gif_thread_main, "gif", NULL);
+			if (!gif_thread) {
+				// encode on the emulation thread instead
+				SDL_DestroySemaphore(gif_queue_free_sem);
+				SDL_DestroySemaphore(gif_queue_full_sem);
+			}
+		} else {
 			record_gif = RECORD_GIF_DISABLED;
 		}
 	}
 
+	if (video_out_path && !video_capture_begin(video_out_path)) {
+		exit(1);
+	}
+
 	if (debugger_enabled) {
 		DEBUGInitUI(renderer);
 	}
 
+	if (use_render_thread) {
+		render_ram = malloc(sizeof(video_ram));
+		memcpy(render_ram, video_ram, sizeof(video_ram));
+		render_queue_sem = SDL_CreateSemaphore(0);
+		render_sync_sem = SDL_CreateSemaphore(0);
+		render_thread = SDL_CreateThread(render_thread_main, "render", NULL);
+		if (!render_thread) {
+			fprintf(stderr, "SDL_CreateThread failed: %s\n", SDL_GetError());
+			// render on the CPU thread instead
+			SDL_DestroySemaphore(render_queue_sem);
+			SDL_DestroySemaphore(render_sync_sem);
+			free(render_ram);
+			render_ram = video_ram;
+		}
+	}
+
 	return true;
 }
 
@@ -258,10 +515,30 @@ struct video_layer_properties
 	uint8_t first_color_pos;
 	uint8_t color_mask;
 	uint8_t color_fields_max;
+
+	// Bitmap mode: palette offset and a lookup table that expands one
+	// VRAM byte into its 8 >> color_depth palette indices.
+	uint8_t palette_offset;
+	uint8_t bitmap_lut[256][8];
 };
 
 struct video_layer_properties layer_properties[2];
 
+struct video_composer_properties
+{
+	// layer x for every screen x, and layer y for every screen y
+	int eff_x[SCREEN_WIDTH];
+	int eff_y[SCREEN_HEIGHT];
+
+	// number of layer pixels that are visible on a line
+	uint16_t layer_width;
+
+	// HSCALE is exactly 2:1
+	bool hscale_half;
+};
+
+struct video_composer_properties composer_properties;
+
 static int
 calc_layer_eff_x(const struct video_layer_properties *props, const int x)
 {
@@ -292,8 +569,9 @@ refresh_layer_properties(const uint8_t layer)
 {
 	struct video_layer_properties* props = &layer_properties[layer];
 
-	uint16_t prev_layerw_max = props->layerw_max;
-	uint16_t prev_hscroll = props->hscroll;
+	uint8_t  prev_color_depth = props->color_depth;
+	uint8_t  prev_palette_offset = props->palette_offset;
+	bool     prev_bitmap_mode = props->bitmap_mode;
 
 	props->color_depth    = reg_layer[layer][0] & 0x3;
 	props->map_base       = reg_layer[layer][1] << 9;
@@ -344,20 +622,14 @@ refresh_layer_properties(const uint8_t layer)
 	props->layerh_max = (maph * props->tileh) - 1;
 
 	// Find min/max eff_x for bulk reading in tile data during draw.
-	if (prev_layerw_max != props->layerw_max || prev_hscroll != props->hscroll) {
-		int min_eff_x = INT_MAX;
-		int max_eff_x = INT_MIN;
-		for (int x = 0; x < SCREEN_WIDTH; ++x) {
-			int eff_x = calc_layer_eff_x(props, x);
-			if (eff_x < min_eff_x) {
-				min_eff_x = eff_x;
-			}
-			if (eff_x > max_eff_x) {
-				max_eff_x = eff_x;
-			}
-		}
-		props->min_eff_x = min_eff_x;
-		props->max_eff_x = max_eff_x;
+	const int first_eff_x = calc_layer_eff_x(props, 0);
+	if (first_eff_x + SCREEN_WIDTH - 1 <= props->layerw_max) {
+		props->min_eff_x = first_eff_x;
+		props->max_eff_x = first_eff_x + SCREEN_WIDTH - 1;
+	} else {
+		// the line wraps around the layer
+		props->min_eff_x = 0;
+		props->max_eff_x = props->layerw_max;
 	}
 
 	props->bits_per_pixel = 1 << props->color_depth;
@@ -366,6 +638,57 @@ refresh_layer_properties(const uint8_t layer)
 	props->first_color_pos  = 8 - props->bits_per_pixel;
 	props->color_mask       = (1 << props->bits_per_pixel) - 1;
 	props->color_fields_max = (8 >> props->color_depth) - 1;
+
+	props->palette_offset = props->bitmap_mode ? (reg_layer[layer][4] & 0xf) << 4 : 0;
+
+	// Rebuild the bitmap byte expansion table only if its inputs changed.
+	if (props->bitmap_mode && (!prev_bitmap_mode || prev_color_depth != props->color_depth || prev_palette_offset != props->palette_offset)) {
+		for (int b = 0; b < 256; ++b) {
+			for (int i = 0; i <= props->color_fields_max; ++i) {
+				uint8_t col_index = (b >> (props->first_color_pos - (i << props->color_depth))) & props->color_mask;
+
+				// Apply Palette Offset
+				if (col_index > 0 && col_index < 16) {
+					col_index += props->palette_offset;
+				}
+				props->bitmap_lut[b][i] = col_index;
+			}
+		}
+	}
+}
+
+static void
+refresh_composer_properties()
+{
+	struct video_composer_properties* props = &composer_properties;
+
+	const uint8_t  hscale = reg_composer[1];
+	const uint8_t  vscale = reg_composer[2];
+	const uint16_t hstart = reg_composer[4] << 2;
+	const uint16_t vstart = reg_composer[6] << 1;
+
+	int max_eff_x = 0;
+	for (int x = 0; x < SCREEN_WIDTH; ++x) {
+		int eff_x = (hscale * (x - hstart)) >> 7;
+		// pixels left of hstart are border, pixels beyond the layer line
+		// (HSCALE > 1.0) repeat its last pixel
+		if (eff_x < 0) {
+			eff_x = 0;
+		} else if (eff_x >= SCREEN_WIDTH) {
+			eff_x = SCREEN_WIDTH - 1;
+		}
+		props->eff_x[x] = eff_x;
+		if (eff_x > max_eff_x) {
+			max_eff_x = eff_x;
+		}
+	}
+	for (int y = 0; y < SCREEN_HEIGHT; ++y) {
+		props->eff_y[y] = (vscale * (y - vstart)) >> 7;
+	}
+
+	// round up to whole iterations of the composer
+	props->layer_width = (max_eff_x + LAYER_PIXELS_PER_ITERATION) & ~(LAYER_PIXELS_PER_ITERATION - 1);
+	props->hscale_half = hscale == 64;
 }
 
 struct video_sprite_properties
@@ -391,6 +714,10 @@ struct video_sprite_properties
 
 struct video_sprite_properties sprite_properties[128];
 
+// sprites whose attributes changed since the last line was rendered
+static uint16_t sprite_dirty_begin = NUM_SPRITES;
+static uint16_t sprite_dirty_end;
+
 static void
 refresh_sprite_properties(const uint16_t sprite)
 {
@@ -423,19 +750,62 @@ refresh_sprite_properties(const uint16_t sprite)
 	props->palette_offset = (sprite_data[sprite][7] & 0x0f) << 4;
 }
 
+static void
+mark_sprite_dirty(const uint16_t sprite)
+{
+	if (sprite < sprite_dirty_begin) {
+		sprite_dirty_begin = sprite;
+	}
+	if (sprite >= sprite_dirty_end) {
+		sprite_dirty_end = sprite + 1;
+	}
+}
+
+static void
+refresh_dirty_sprites()
+{
+	for (uint16_t i = sprite_dirty_begin; i < sprite_dirty_end; i++) {
+		refresh_sprite_properties(i);
+	}
+	sprite_dirty_begin = NUM_SPRITES;
+	sprite_dirty_end = 0;
+}
+
 struct video_palette
 {
 	uint32_t entries[256];
-	bool dirty;
+	uint32_t entries_dim[256]; // NTSC overscan area
+	uint16_t dirty_begin;      // range of entries to recompute
+	uint16_t dirty_end;
 };
 
 struct video_palette video_palette;
 
+static uint32_t
+map_rgb(uint8_t r, uint8_t g, uint8_t b)
+{
+	if (texture_format) {
+		return SDL_MapRGB(texture_format, r, g, b);
+	}
+	return (uint32_t)(r << 16) | ((uint32_t)g << 8) | ((uint32_t)b);
+}
+
+static void
+mark_palette_dirty(uint16_t begin, uint16_t end)
+{
+	if (begin < video_palette.dirty_begin) {
+		video_palette.dirty_begin = begin;
+	}
+	if (end > video_palette.dirty_end) {
+		video_palette.dirty_end = end;
+	}
+}
+
 static void
 refresh_palette() {
 	const uint8_t out_mode = reg_composer[0] & 3;
 	const bool chroma_disable = (reg_composer[0] >> 2) & 1;
-	for (int i = 0; i < 256; ++i) {
+	for (int i = video_palette.dirty_begin; i < video_palette.dirty_end; ++i) {
 		uint8_t r;
 		uint8_t g;
 		uint8_t b;
@@ -455,9 +825,11 @@ refresh_palette() {
 			}
 		}
 
-		video_palette.entries[i] = (uint32_t)(r << 16) | ((uint32_t)g << 8) | ((uint32_t)b);
+		video_palette.entries[i] = map_rgb(r, g, b);
+		video_palette.entries_dim[i] = map_rgb(r >> 2, g >> 2, b >> 2);
 	}
-	video_palette.dirty = false;
+	video_palette.dirty_begin = 256;
+	video_palette.dirty_end = 0;
 }
 
 static void
@@ -474,6 +846,13 @@ expand_4bpp_data(uint8_t *dst, const uint8_t *src, int dst_size)
 	}
 }
 
+// render-side view of VRAM
+static uint8_t
+render_space_read(uint32_t address)
+{
+	return render_ram[address & 0x1FFFF];
+}
+
 static void
 render_sprite_line(const uint16_t y)
 {
@@ -501,7 +880,18 @@ render_sprite_line(const uint16_t y)
 		int16_t       eff_sx      = (props->hflip ? (props->sprite_width - 1) : 0);
 		const int16_t eff_sx_incr = props->hflip ? -1 : 1;
 
-		const uint8_t *bitmap_data = video_ram + props->sprite_address + (eff_sy << (props->sprite_width_log2 - (1 - props->color_mode)));
+		const uint32_t line_address = (props->sprite_address + (eff_sy << (props->sprite_width_log2 - (1 - props->color_mode)))) & 0x1FFFF;
+		const uint16_t line_bytes = props->sprite_width >> (1 - props->color_mode);
+		const uint8_t *bitmap_data = render_ram + line_address;
+
+		// the sprite data wraps around at the end of VRAM
+		uint8_t wrapped_sprite_line[64];
+		if (line_address + line_bytes > 0x20000) {
+			for (uint16_t i = 0; i < line_bytes; i++) {
+				wrapped_sprite_line[i] = render_ram[(line_address + i) & 0x1FFFF];
+			}
+			bitmap_data = wrapped_sprite_line;
+		}
 
 		uint8_t unpacked_sprite_line[64];
 		if (props->color_mode == 0) {
@@ -545,13 +935,12 @@ render_sprite_line(const uint16_t y)
 }
 
 static void
-render_layer_line_text(uint8_t layer, uint16_t y)
+render_layer_line_text(uint8_t layer, uint16_t y, uint16_t width)
 {
 	const struct video_layer_properties *props = &layer_properties[layer];
 
-	const uint8_t max_pixels_per_byte = (8 >> props->color_depth) - 1;
-	const int     eff_y               = calc_layer_eff_y(props, y);
-	const int     yy                  = eff_y & props->tileh_max;
+	const int eff_y = calc_layer_eff_y(props, y);
+	const int yy    = eff_y & props->tileh_max;
 
 	// additional bytes to reach the correct line of the tile
 	const uint32_t y_add = (yy << props->tilew_log2) >> 3;
@@ -563,23 +952,25 @@ render_layer_line_text(uint8_t layer, uint16_t y)
 	uint8_t tile_bytes[512]; // max 256 tiles, 2 bytes each.
 	video_space_read_range(tile_bytes, map_addr_begin, size);
 
-	uint32_t tile_start;
-
-	uint8_t  fg_color;
-	uint8_t  bg_color;
-	uint8_t  s;
-	uint8_t  color_shift;
+	// Render whole character lines starting at the character containing
+	// the first pixel, then copy the visible part into the layer line.
+	const int first_xx    = calc_layer_eff_x(props, 0) & props->tilew_max;
+	const int num_tiles   = (first_xx + width + props->tilew_max) >> props->tilew_log2;
+	const int bytes_per_x = props->tilew >> 3;
 
-	{
-		const int eff_x = calc_layer_eff_x(props, 0);
-		const int xx    = eff_x & props->tilew_max;
+	uint8_t tile_line[SCREEN_WIDTH + 16];
+	uint8_t *dst = tile_line;
+	int eff_x = calc_layer_eff_x(props, 0) - first_xx;
 
+	for (int t = 0; t < num_tiles; t++) {
 		// extract all information from the map
 		const uint32_t map_addr = calc_layer_map_addr_base2(props, eff_x, eff_y) - map_addr_begin;
 
 		const uint8_t tile_index = tile_bytes[map_addr];
 		const uint8_t byte1      = tile_bytes[map_addr + 1];
 
+		uint8_t fg_color;
+		uint8_t bg_color;
 		if (!props->text_mode_256c) {
 			fg_color = byte1 & 15;
 			bg_color = byte1 >> 4;
@@ -587,61 +978,31 @@ render_layer_line_text(uint8_t layer, uint16_t y)
 			fg_color = byte1;
 			bg_color = 0;
 		}
+		const uint64_t fg8 = fg_color * 0x0101010101010101ull;
+		const uint64_t bg8 = bg_color * 0x0101010101010101ull;
 
 		// offset within tilemap of the current tile
-		tile_start = tile_index << props->tile_size_log2;
-
-		// additional bytes to reach the correct column of the tile
-		const uint16_t x_add       = xx >> 3;
-		const uint32_t tile_offset = tile_start + y_add + x_add;
-
-		s           = video_space_read(props->tile_base + tile_offset);
-		color_shift = max_pixels_per_byte - xx;
-	}
-
-	// Render tile line.
-	for (int x = 0; x < SCREEN_WIDTH; x++) {
-		// Scrolling
-		const int eff_x = calc_layer_eff_x(props, x);
-		const int xx = eff_x & props->tilew_max;
-
-		if ((eff_x & 0x7) == 0) {
-			if ((eff_x & props->tilew_max) == 0) {
-				// extract all information from the map
-				const uint32_t map_addr = calc_layer_map_addr_base2(props, eff_x, eff_y) - map_addr_begin;
-
-				const uint8_t tile_index = tile_bytes[map_addr];
-				const uint8_t byte1      = tile_bytes[map_addr + 1];
-
-				if (!props->text_mode_256c) {
-					fg_color = byte1 & 15;
-					bg_color = byte1 >> 4;
-				} else {
-					fg_color = byte1;
-					bg_color = 0;
-				}
-
-				// offset within tilemap of the current tile
-				tile_start = tile_index << props->tile_size_log2;
-			}
+		const uint32_t tile_start = (tile_index << props->tile_size_log2) + y_add;
 
-			// additional bytes to reach the correct column of the tile
-			const uint16_t x_add       = xx >> 3;
-			const uint32_t tile_offset = tile_start + y_add + x_add;
+		for (int x_add = 0; x_add < bytes_per_x; x_add++) {
+			const uint8_t s = render_space_read(props->tile_base + tile_start + x_add);
 
-			s           = video_space_read(props->tile_base + tile_offset);
-			color_shift = max_pixels_per_byte;
+			// select fg or bg for 8 pixels at a time
+			uint64_t mask;
+			memcpy(&mask, text_mask_lut[s], 8);
+			const uint64_t pixels = (fg8 & mask) | (bg8 & ~mask);
+			memcpy(dst, &pixels, 8);
+			dst += 8;
 		}
 
-		// convert tile byte to indexed color
-		const uint8_t col_index = (s >> color_shift) & 1;
-		--color_shift;
-		layer_line[layer][x] = col_index ? fg_color : bg_color;
+		eff_x = (eff_x + props->tilew) & props->layerw_max;
 	}
+
+	memcpy(layer_line[layer], tile_line + first_xx, width);
 }
 
 static void
-render_layer_line_tile(uint8_t layer, uint16_t y)
+render_layer_line_tile(uint8_t layer, uint16_t y, uint16_t width)
 {
 	struct video_layer_properties *props = &layer_properties[layer];
 
@@ -700,12 +1061,12 @@ render_layer_line_tile(uint8_t layer, uint16_t y)
 		uint16_t x_add       = (xx << props->color_depth) >> 3;
 		uint32_t tile_offset = tile_start + (vflip ? y_add_flip : y_add) + x_add;
 
-		s = video_space_read(props->tile_base + tile_offset);
+		s = render_space_read(props->tile_base + tile_offset);
 	}
 
 
 	// Render tile line.
-	for (int x = 0; x < SCREEN_WIDTH; x++) {
+	for (int x = 0; x < width; x++) {
 		const int eff_x = calc_layer_eff_x(props, x);
 
 		if ((eff_x & max_pixels_per_byte) == 0) {
@@ -741,7 +1102,7 @@ render_layer_line_tile(uint8_t layer, uint16_t y)
 			const uint16_t x_add       = (xx << props->color_depth) >> 3;
 			const uint32_t tile_offset = tile_start + (vflip ? y_add_flip : y_add) + x_add;
 
-			s = video_space_read(props->tile_base + tile_offset);
+			s = render_space_read(props->tile_base + tile_offset);
 		}
 
 		// convert tile byte to indexed color
@@ -758,34 +1119,58 @@ render_layer_line_tile(uint8_t layer, uint16_t y)
 
 
 static void
-render_layer_line_bitmap(uint8_t layer, uint16_t y)
+render_layer_line_bitmap(uint8_t layer, uint16_t y, uint16_t width)
 {
-	struct video_layer_properties *props = &layer_properties[layer];
-
-	int yy = y % props->tileh;
-	// additional bytes to reach the correct line of the tile
-	uint32_t y_add = (yy * props->tilew * props->bits_per_pixel) >> 3;
-
-	// Render tile line.
-	for (int x = 0; x < SCREEN_WIDTH; x++) {
-		int xx = x % props->tilew;
+	const struct video_layer_properties *props = &layer_properties[layer];
 
-		// extract all information from the map
-		uint8_t palette_offset = reg_layer[layer][4] & 0xf;
+	const int yy = y % props->tileh;
+	// additional bytes to reach the correct line of the bitmap
+	const uint32_t y_add = yy * ((props->tilew << props->color_depth) >> 3);
+	// pixels and bytes of the bitmap line that are visible
+	const uint16_t pixels   = width < props->tilew ? width : props->tilew;
+	const uint16_t row_size = ((pixels << props->color_depth) + 7) >> 3;
 
-		// additional bytes to reach the correct column of the tile
-		uint16_t x_add = (xx * props->bits_per_pixel) >> 3;
-		uint32_t tile_offset = y_add + x_add;
-		uint8_t s = video_space_read(props->tile_base + tile_offset);
+	uint8_t *line = layer_line[layer];
 
-		// convert tile byte to indexed color
-		uint8_t col_index = (s >> (props->first_color_pos - ((xx & props->color_fields_max) << props->color_depth))) & props->color_mask;
+	if (props->color_depth == 3) {
+		// 8bpp: the bitmap line is the color index line
+		video_space_read_range(line, props->tile_base + y_add, row_size);
 
 		// Apply Palette Offset
-		if (palette_offset && col_index > 0 && col_index < 16) {
-			col_index += palette_offset << 4;
+		if (props->palette_offset) {
+			const uint8_t palette_offset = props->palette_offset;
+			for (int x = 0; x < pixels; x++) {
+				const uint8_t col_index = line[x];
+				line[x] = col_index + ((uint8_t)(col_index - 1) < 15 ? palette_offset : 0);
+			}
 		}
-		layer_line[layer][x] = col_index;
+	} else {
+		uint8_t row_bytes[SCREEN_WIDTH / 2]; // max. 640 pixels at 4bpp
+		video_space_read_range(row_bytes, props->tile_base + y_add, row_size);
+
+		// convert each bitmap byte into its indexed colors
+		switch (props->color_depth) {
+			case 0:
+				for (int i = 0; i < row_size; i++, line += 8) {
+					memcpy(line, props->bitmap_lut[row_bytes[i]], 8);
+				}
+				break;
+			case 1:
+				for (int i = 0; i < row_size; i++, line += 4) {
+					memcpy(line, props->bitmap_lut[row_bytes[i]], 4);
+				}
+				break;
+			case 2:
+				for (int i = 0; i < row_size; i++, line += 2) {
+					memcpy(line, props->bitmap_lut[row_bytes[i]], 2);
+				}
+				break;
+		}
+	}
+
+	// 320 pixel wide bitmaps repeat across the line
+	for (int x = props->tilew; x < width; x += props->tilew) {
+		memcpy(&layer_line[layer][x], layer_line[layer], props->tilew);
 	}
 }
 
@@ -809,210 +1194,450 @@ static uint8_t calculate_line_col_index(uint8_t spr_zindex, uint8_t spr_col_inde
 	return col_index;
 }
 
-static void
-render_line(uint16_t y)
+static uint64_t
+hash_add(uint64_t h, uint64_t value)
 {
-	uint8_t out_mode = reg_composer[0] & 3;
+	h ^= value;
+	h *= 0x100000001b3ull;
+	return h ^ (h >> 29);
+}
 
-	uint8_t border_color = reg_composer[3];
-	uint16_t hstart = reg_composer[4] << 2;
-	uint16_t hstop = reg_composer[5] << 2;
-	uint16_t vstart = reg_composer[6] << 1;
-	uint16_t vstop = reg_composer[7] << 1;
+static uint64_t
+hash_add_bytes(uint64_t h, const uint8_t *data, int size)
+{
+	int i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t value;
+		memcpy(&value, &data[i], 8);
+		h = hash_add(h, value);
+	}
+	for (; i < size; ++i) {
+		h = hash_add(h, data[i]);
+	}
+	return h;
+}
 
-	int eff_y = (reg_composer[2] * (y - vstart)) >> 7;
+// latest write generation of the VRAM range [address, address + size)
+static uint64_t
+vram_range_gen(uint32_t address, uint32_t size, int shift, const uint64_t *gens)
+{
+	uint64_t gen = 0;
+	const uint32_t first = address >> shift;
+	const uint32_t last  = (address + size - 1) >> shift;
+	for (uint32_t i = first; i <= last; ++i) {
+		const uint64_t g = gens[i & ((0x20000 >> shift) - 1)];
+		if (g > gen) {
+			gen = g;
+		}
+	}
+	return gen;
+}
 
-	uint8_t dc_video = reg_composer[0];
-	layer_line_enable[0] = dc_video & 0x10;
-	layer_line_enable[1] = dc_video & 0x20;
-	sprite_line_enable   = dc_video & 0x40;
+// latest write generation of all VRAM a layer line reads
+static uint64_t
+calc_layer_line_vram_gen(uint8_t layer, uint16_t y)
+{
+	const struct video_layer_properties *props = &layer_properties[layer];
 
-	if (sprite_line_enable) {
-		render_sprite_line(eff_y);
+	if (props->bitmap_mode) {
+		const uint16_t row_size = (props->tilew << props->color_depth) >> 3;
+		const uint32_t y_add    = (y % props->tileh) * row_size;
+		return vram_range_gen(props->tile_base + y_add, row_size, VRAM_BLOCK_SHIFT, vram_block_gen);
 	}
 
-	if (warp_mode && (frame_count & 63)) {
-		// sprites were needed for the collision IRQ, but we can skip
-		// everything else if we're in warp mode, most of the time
-		return;
+	const int      eff_y          = calc_layer_eff_y(props, y);
+	const uint32_t map_addr_begin = calc_layer_map_addr_base2(props, props->min_eff_x, eff_y);
+	const uint32_t map_addr_end   = calc_layer_map_addr_base2(props, props->max_eff_x, eff_y);
+	const uint64_t map_gen        = vram_range_gen(map_addr_begin, (map_addr_end - map_addr_begin) + 2, VRAM_BLOCK_SHIFT, vram_block_gen);
+
+	uint32_t tile_data_size = (props->text_mode ? 256 : 1024) << props->tile_size_log2;
+	if (tile_data_size > 0x20000) {
+		tile_data_size = 0x20000;
 	}
+	const uint64_t tile_gen = vram_range_gen(props->tile_base, tile_data_size, VRAM_AREA_SHIFT, vram_area_gen);
 
-	if (layer_line_enable[0]) {
-		if (layer_properties[0].text_mode) {
-			render_layer_line_text(0, eff_y);
-		} else if (layer_properties[0].bitmap_mode) {
-			render_layer_line_bitmap(0, eff_y);
-		} else {
-			render_layer_line_tile(0, eff_y);
+	return map_gen > tile_gen ? map_gen : tile_gen;
+}
+
+static uint64_t
+calc_line_hash(uint16_t eff_y)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	h = hash_add_bytes(h, reg_composer, sizeof(reg_composer));
+	h = hash_add(h, palette_gen);
+	for (uint8_t layer = 0; layer < 2; ++layer) {
+		if (layer_line_enable[layer]) {
+			h = hash_add_bytes(h, reg_layer[layer], sizeof(reg_layer[layer]));
+			h = hash_add(h, calc_layer_line_vram_gen(layer, eff_y));
 		}
 	}
-	if (layer_line_enable[1]) {
-		if (layer_properties[1].text_mode) {
-			render_layer_line_text(1, eff_y);
-		} else if (layer_properties[1].bitmap_mode) {
-			render_layer_line_bitmap(1, eff_y);
-		} else {
-			render_layer_line_tile(1, eff_y);
-		}
+	if (sprite_line_enable) {
+		h = hash_add_bytes(h, sprite_line_col, SCREEN_WIDTH);
+		h = hash_add_bytes(h, sprite_line_z, SCREEN_WIDTH);
 	}
+	return h | 1;
+}
 
-	uint8_t col_line[SCREEN_WIDTH];
-
-	if (video_palette.dirty) {
-		refresh_palette();
-	}
+// Calculate color without border for the first width pixels of col_line,
+// line_eff_x maps each pixel to its position on the layer and sprite lines.
+static void
+compose_layer_line(uint8_t *col_line, const int *line_eff_x, uint16_t width)
+{
+	uint8_t spr_col_index[LAYER_PIXELS_PER_ITERATION];
+	uint8_t l1_col_index[LAYER_PIXELS_PER_ITERATION];
+	uint8_t l2_col_index[LAYER_PIXELS_PER_ITERATION];
+	uint8_t spr_zindex[LAYER_PIXELS_PER_ITERATION];
 
-	// If video output is enabled, calculate color indices for line.
-	if (out_mode != 0) {
-		uint8_t spr_col_index[LAYER_PIXELS_PER_ITERATION];
-		uint8_t l1_col_index[LAYER_PIXELS_PER_ITERATION];
-		uint8_t l2_col_index[LAYER_PIXELS_PER_ITERATION];
-		uint8_t spr_zindex[LAYER_PIXELS_PER_ITERATION];
-
-		memset(spr_col_index, 0, sizeof(spr_col_index));
-		memset(l1_col_index, 0, sizeof(l1_col_index));
-		memset(l2_col_index, 0, sizeof(l2_col_index));
-		memset(spr_zindex, 0, sizeof(spr_zindex));
-
-		// Calculate color without border.
-		for (uint16_t x = 0; x < SCREEN_WIDTH; x+=LAYER_PIXELS_PER_ITERATION) {
-			uint8_t col_index[LAYER_PIXELS_PER_ITERATION];
-			memset(col_index, 0, sizeof(col_index));
-
-			int eff_x[LAYER_PIXELS_PER_ITERATION];
-			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-				eff_x[i] = (reg_composer[1] * (x + i - hstart)) >> 7;
-			}
+	memset(spr_col_index, 0, sizeof(spr_col_index));
+	memset(l1_col_index, 0, sizeof(l1_col_index));
+	memset(l2_col_index, 0, sizeof(l2_col_index));
+	memset(spr_zindex, 0, sizeof(spr_zindex));
 
-			if (sprite_line_enable) {
-				for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-					spr_col_index[i] = sprite_line_col[eff_x[i]];
-				}
-			}
+	for (uint16_t x = 0; x < width; x+=LAYER_PIXELS_PER_ITERATION) {
+		uint8_t col_index[LAYER_PIXELS_PER_ITERATION];
+		memset(col_index, 0, sizeof(col_index));
 
-			if (layer_line_enable[0]) {
-				for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-					l1_col_index[i] = layer_line[0][eff_x[i]];
-				}
-			}
+		const int *eff_x = &line_eff_x[x];
 
-			if (layer_line_enable[1]) {
-				for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-					l2_col_index[i] = layer_line[1][eff_x[i]];
-				}
+		if (sprite_line_enable) {
+			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+				spr_col_index[i] = sprite_line_col[eff_x[i]];
 			}
+		}
 
+		if (layer_line_enable[0]) {
 			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-				spr_zindex[i] = sprite_line_z[eff_x[i]];
+				l1_col_index[i] = layer_line[0][eff_x[i]];
 			}
+		}
 
-			bool same_sprite = true;
-			for (int i = 1; same_sprite && i < LAYER_PIXELS_PER_ITERATION; ++i) {
-				same_sprite &= spr_zindex[0] == spr_zindex[i];
+		if (layer_line_enable[1]) {
+			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+				l2_col_index[i] = layer_line[1][eff_x[i]];
 			}
+		}
 
-			if (same_sprite) {
-				switch (spr_zindex[0]) {
-					case 3:
-						for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-							col_index[i] = spr_col_index[i] ? spr_col_index[i] : (l2_col_index[i] ? l2_col_index[i] : l1_col_index[i]);
-						}
-						break;
-					case 2:
-						for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-							col_index[i] = l2_col_index[i] ? l2_col_index[i] : (spr_col_index[i] ? spr_col_index[i] : l1_col_index[i]);
-						}
-						break;
-					case 1:
-						for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-							col_index[i] = l2_col_index[i] ? l2_col_index[i] : (l1_col_index[i] ? l1_col_index[i] : spr_col_index[i]);
-						}
-						break;
-					case 0:
-						for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-							col_index[i] = l2_col_index[i] ? l2_col_index[i] : l1_col_index[i];
-						}
-						break;
-				}
-			} else {
-				for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-					col_index[i] = calculate_line_col_index(spr_zindex[i], spr_col_index[i], l1_col_index[i], l2_col_index[i]);
-				}
-			}
+		for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+			spr_zindex[i] = sprite_line_z[eff_x[i]];
+		}
 
-			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
-				col_line[x+i] = col_index[i];
-			}
+		bool same_sprite = true;
+		for (int i = 1; same_sprite && i < LAYER_PIXELS_PER_ITERATION; ++i) {
+			same_sprite &= spr_zindex[0] == spr_zindex[i];
 		}
 
-		// Add border after if required.
-		if (y < vstart || y > vstop) {
-			uint32_t border_fill = border_color;
-			border_fill     = border_fill | (border_fill << 8);
-			border_fill     = border_fill | (border_fill << 16);
-			memset(col_line, border_fill, SCREEN_WIDTH);
-		} else {
-			for (uint16_t x = 0; x < hstart; ++x) {
-				col_line[x] = border_color;
+		if (same_sprite) {
+			switch (spr_zindex[0]) {
+				case 3:
+					for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+						col_index[i] = spr_col_index[i] ? spr_col_index[i] : (l2_col_index[i] ? l2_col_index[i] : l1_col_index[i]);
+					}
+					break;
+				case 2:
+					for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+						col_index[i] = l2_col_index[i] ? l2_col_index[i] : (spr_col_index[i] ? spr_col_index[i] : l1_col_index[i]);
+					}
+					break;
+				case 1:
+					for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+						col_index[i] = l2_col_index[i] ? l2_col_index[i] : (l1_col_index[i] ? l1_col_index[i] : spr_col_index[i]);
+					}
+					break;
+				case 0:
+					for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+						col_index[i] = l2_col_index[i] ? l2_col_index[i] : l1_col_index[i];
+					}
+					break;
 			}
-			for (uint16_t x = hstop; x < SCREEN_WIDTH; ++x) {
-				col_line[x] = border_color;
+		} else {
+			for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+				col_index[i] = calculate_line_col_index(spr_zindex[i], spr_col_index[i], l1_col_index[i], l2_col_index[i]);
 			}
 		}
-	}
 
-	// Look up all color indices.
-	uint32_t* framebuffer4_begin = ((uint32_t*)framebuffer) + (y * SCREEN_WIDTH);
-	{
-		uint32_t* framebuffer4 = framebuffer4_begin;
-		for (uint16_t x = 0; x < SCREEN_WIDTH; x++) {
-			*framebuffer4++ = video_palette.entries[col_line[x]];
+		for (int i = 0; i < LAYER_PIXELS_PER_ITERATION; ++i) {
+			col_line[x+i] = col_index[i];
 		}
 	}
+}
 
-	// NTSC overscan
-	if (out_mode == 2) {
-		uint32_t* framebuffer4 = framebuffer4_begin;
-		for (uint16_t x = 0; x < SCREEN_WIDTH; x++)
+// Whether line y can be part of a 320x240 frame
+static bool
+line_fits_half(uint16_t y, uint8_t out_mode, uint64_t hash)
+{
+	if (!composer_properties.hscale_half || reg_composer[2] != 64 || out_mode == 2) {
+		// not 2:1, or NTSC with its darkened overscan area
+		return false;
+	}
+	if (y & 1) {
+		// the hash covers all registers, so they are the same for both lines
+		const uint16_t vstart = reg_composer[6] << 1;
+		const uint16_t vstop = reg_composer[7] << 1;
+		return hash == line_hash[y - 1] &&
+			composer_properties.eff_y[y] == composer_properties.eff_y[y - 1] &&
+			(y < vstart || y > vstop) == (y - 1 < vstart || y - 1 > vstop);
+	}
+	return true;
+}
+
+// decide at the first line whether this frame is rendered at 320x240
+static void
+start_frame_layout()
+{
+	// GIF, capture and the debugger need every frame at 640x480
+	const bool half = half_compatible && sdlTextureHalf && !capture_file && record_gif == RECORD_GIF_DISABLED && !debugger_enabled;
+	if (half != frame_half) {
+		// all lines move within the framebuffer
+		memset(line_hash, 0, sizeof(line_hash));
+		frame_half = half;
+	}
+	half_compatible = true;
+}
+
+// Line y doesn't fit a 320x240 frame: convert the lines before it to
+// 640x480 and render the rest of the frame at full resolution.
+static void
+leave_half_layout(uint16_t y)
+{
+	uint32_t *pixels = (uint32_t *)framebuffer;
+	for (int row = (y + 1) / 2 - 1; row >= 0; row--) {
+		// back to front, the full resolution lines are further down
+		const uint32_t *src = &pixels[row * HALF_WIDTH];
+		uint32_t *dst = &pixels[row * 2 * SCREEN_WIDTH];
+		for (int x = HALF_WIDTH - 1; x >= 0; x--) {
+			const uint32_t pixel = src[x];
+			dst[x * 2 + 1] = pixel;
+			dst[x * 2] = pixel;
+		}
+		memcpy(dst + SCREEN_WIDTH, dst, SCREEN_WIDTH * 4);
+	}
+	for (uint16_t i = 0; i < y; i++) {
+		line_frame[i] = present_serial;
+	}
+	memset(&line_hash[y], 0, (SCREEN_HEIGHT - y) * sizeof(line_hash[0]));
+	frame_half = false;
+}
+
+// render line y (and y + 1) into framebuffer row y / 2 of a 320x240 frame
+static void
+render_half_line(uint16_t y, uint8_t out_mode)
+{
+	uint8_t border_color = reg_composer[3];
+	uint16_t hstart = reg_composer[4] << 1;
+	uint16_t hstop = reg_composer[5] << 1;
+	uint16_t vstart = reg_composer[6] << 1;
+	uint16_t vstop = reg_composer[7] << 1;
+
+	uint8_t col_line[HALF_WIDTH];
+
+	if (out_mode != 0) {
+		if (y < vstart || y > vstop) {
+			memset(col_line, border_color, HALF_WIDTH);
+		} else {
+			uint8_t layer_col_line[HALF_WIDTH];
+			compose_layer_line(layer_col_line, identity_eff_x, composer_properties.layer_width);
+
+			for (uint16_t x = 0; x < hstart && x < HALF_WIDTH; ++x) {
+				col_line[x] = border_color;
+			}
+			if (hstart < HALF_WIDTH) {
+				memcpy(&col_line[hstart], layer_col_line, HALF_WIDTH - hstart);
+			}
+			for (uint16_t x = hstop; x < HALF_WIDTH; ++x) {
+				col_line[x] = border_color;
+			}
+		}
+	}
+
+	uint32_t* framebuffer4 = ((uint32_t*)framebuffer) + (y / 2 * HALF_WIDTH);
+	for (uint16_t x = 0; x < HALF_WIDTH; x++) {
+		*framebuffer4++ = video_palette.entries[col_line[x]];
+	}
+}
+
+static void
+render_line(uint16_t y, bool layers_skipped)
+{
+	uint8_t out_mode = reg_composer[0] & 3;
+
+	uint8_t border_color = reg_composer[3];
+	uint16_t hstart = reg_composer[4] << 2;
+	uint16_t hstop = reg_composer[5] << 2;
+	uint16_t vstart = reg_composer[6] << 1;
+	uint16_t vstop = reg_composer[7] << 1;
+
+	int eff_y = composer_properties.eff_y[y];
+	uint16_t layer_width = composer_properties.layer_width;
+
+	uint8_t dc_video = reg_composer[0];
+	layer_line_enable[0] = dc_video & 0x10;
+	layer_line_enable[1] = dc_video & 0x20;
+	sprite_line_enable   = dc_video & 0x40;
+
+	if (sprite_dirty_begin < sprite_dirty_end) {
+		refresh_dirty_sprites();
+	}
+
+	if (sprite_line_enable) {
+		render_sprite_line(eff_y);
+	}
+
+	if (layers_skipped) {
+		// sprites were needed for the collision IRQ, but we can skip
+		// everything else in a skipped frame
+		return;
+	}
+
+	if (y == 0) {
+		start_frame_layout();
+	}
+
+	const uint64_t hash = calc_line_hash(eff_y);
+	if (!line_fits_half(y, out_mode, hash)) {
+		half_compatible = false;
+		if (frame_half) {
+			leave_half_layout(y);
+		}
+	}
+	if (frame_half && (y & 1)) {
+		// same as the line above, which is already in the framebuffer
+		line_hash[y] = hash;
+		return;
+	}
+
+	// keep the framebuffer line if none of its inputs changed
+	if (hash == line_hash[y]) {
+		return;
+	}
+	line_hash[y] = hash;
+
+	line_frame[y] = present_serial;
+
+	if (layer_line_enable[0]) {
+		if (layer_properties[0].text_mode) {
+			render_layer_line_text(0, eff_y, layer_width);
+		} else if (layer_properties[0].bitmap_mode) {
+			render_layer_line_bitmap(0, eff_y, layer_width);
+		} else {
+			render_layer_line_tile(0, eff_y, layer_width);
+		}
+	}
+	if (layer_line_enable[1]) {
+		if (layer_properties[1].text_mode) {
+			render_layer_line_text(1, eff_y, layer_width);
+		} else if (layer_properties[1].bitmap_mode) {
+			render_layer_line_bitmap(1, eff_y, layer_width);
+		} else {
+			render_layer_line_tile(1, eff_y, layer_width);
+		}
+	}
+
+	uint8_t col_line[SCREEN_WIDTH];
+
+	if (video_palette.dirty_begin < video_palette.dirty_end) {
+		refresh_palette();
+	}
+
+	if (frame_half) {
+		render_half_line(y, out_mode);
+		return;
+	}
+
+	// If video output is enabled, calculate color indices for line.
+	if (out_mode != 0) {
+		if (composer_properties.hscale_half) {
+			// 2:1, compose the layer pixels once and double them
+			uint8_t layer_col_line[SCREEN_WIDTH / 2];
+			compose_layer_line(layer_col_line, identity_eff_x, layer_width);
+
+			for (uint16_t x = hstart; x + 1 < SCREEN_WIDTH; x += 2) {
+				memset(&col_line[x], layer_col_line[(x - hstart) >> 1], 2);
+			}
+		} else {
+			compose_layer_line(col_line, composer_properties.eff_x, SCREEN_WIDTH);
+		}
+
+		// Add border after if required.
+		if (y < vstart || y > vstop) {
+			uint32_t border_fill = border_color;
+			border_fill     = border_fill | (border_fill << 8);
+			border_fill     = border_fill | (border_fill << 16);
+			memset(col_line, border_fill, SCREEN_WIDTH);
+		} else {
+			for (uint16_t x = 0; x < hstart; ++x) {
+				col_line[x] = border_color;
+			}
+			for (uint16_t x = hstop; x < SCREEN_WIDTH; ++x) {
+				col_line[x] = border_color;
+			}
+		}
+	}
+
+	if (capture_indices) {
+		if (out_mode != 0) {
+			memcpy(&capture_indices[y * SCREEN_WIDTH], col_line, SCREEN_WIDTH);
+		} else {
+			memset(&capture_indices[y * SCREEN_WIDTH], 0, SCREEN_WIDTH);
+		}
+	}
+
+	// Look up all color indices.
+	uint32_t* framebuffer4 = ((uint32_t*)framebuffer) + (y * SCREEN_WIDTH);
+	if (out_mode == 2) {
+		// NTSC overscan: RGB elements divided by 4 outside the title safe area
+		for (uint16_t x = 0; x < SCREEN_WIDTH; x++)
 		{
 			if (x < SCREEN_WIDTH * TITLE_SAFE_X ||
 				x > SCREEN_WIDTH * (1 - TITLE_SAFE_X) ||
 				y < SCREEN_HEIGHT * TITLE_SAFE_Y ||
 				y > SCREEN_HEIGHT * (1 - TITLE_SAFE_Y)) {
-
-				// Divide RGB elements by 4.
-				*framebuffer4 &= 0x00fcfcfc;
-				*framebuffer4 >>= 2;
+				*framebuffer4++ = video_palette.entries_dim[col_line[x]];
+			} else {
+				*framebuffer4++ = video_palette.entries[col_line[x]];
 			}
-			framebuffer4++;
+		}
+	} else {
+		for (uint16_t x = 0; x < SCREEN_WIDTH; x++) {
+			*framebuffer4++ = video_palette.entries[col_line[x]];
 		}
 	}
 }
 
 bool
-video_step(float mhz)
+video_step(uint8_t mhz, uint32_t clocks)
 {
-	uint8_t out_mode = reg_composer[0] & 3;
-
+	const uint32_t line_length = SCAN_WIDTH * mhz * 1000;
 	bool new_frame = false;
-	float advance = ((out_mode & 2) ? NTSC_PIXEL_FREQ :  VGA_PIXEL_FREQ) / mhz;
-	scan_pos_x += advance;
-	if (scan_pos_x > SCAN_WIDTH) {
-		scan_pos_x -= SCAN_WIDTH;
+
+	for (;;) {
+		uint8_t out_mode = io_reg_composer[0] & 3;
+		uint32_t advance = (out_mode & 2) ? NTSC_PIXEL_FREQ_KHZ : VGA_PIXEL_FREQ_KHZ;
+
+		// nothing happens until the beam reaches the end of the line
+		uint32_t clocks_to_line_end = (line_length - scan_pos_x + advance - 1) / advance;
+		if (clocks < clocks_to_line_end) {
+			scan_pos_x += clocks * advance;
+			return new_frame;
+		}
+		clocks -= clocks_to_line_end;
+		scan_pos_x += clocks_to_line_end * advance - line_length;
+
 		uint16_t back_porch = (out_mode & 2) ? NTSC_BACK_PORCH_Y : VGA_BACK_PORCH_Y;
 		uint16_t y = scan_pos_y - back_porch;
 		if (y < SCREEN_HEIGHT) {
-			render_line(y);
+			render_command(RENDER_CMD_LINE, y, skip_layers);
 		}
 		y++;
 		if (y == SCREEN_HEIGHT) {
 			if (ien & 4) {
+				// collisions are only known once all lines are rendered
+				video_sync_render();
 				if (sprite_line_collisions != 0) {
 					isr |= 4;
 				}
 				isr = (isr & 0xf) | sprite_line_collisions;
 			}
-			sprite_line_collisions = 0;
+			render_command(RENDER_CMD_CLEAR_COLLISIONS, 0, 0);
 			if (ien & 1) { // VSYNC IRQ
 				isr |= 1;
 			}
@@ -1022,6 +1647,9 @@ video_step(float mhz)
 			scan_pos_y = 0;
 			new_frame = true;
 			frame_count++;
+			last_frame_skipped = skip_layers;
+			// in warp mode, we only show every 64th frame
+			skip_layers = warp_mode && (frame_count & 63);
 		}
 		if (ien & 2) { // LINE IRQ
 			y = scan_pos_y - back_porch;
@@ -1030,8 +1658,6 @@ video_step(float mhz)
 			}
 		}
 	}
-
-	return new_frame;
 }
 
 bool
@@ -1041,6 +1667,14 @@ video_get_irq_out()
 	return (tmp_isr & ien) != 0;
 }
 
+// the rendered 640x480 picture, in the texture's pixel format
+const uint8_t *
+video_get_framebuffer()
+{
+	video_sync_render();
+	return framebuffer;
+}
+
 //
 // saves the video memory and register content into a file
 //
@@ -1048,106 +1682,469 @@ video_get_irq_out()
 void
 video_save(SDL_RWops *f)
 {
+	video_sync_render();
+
 	SDL_RWwrite(f, &video_ram[0], sizeof(uint8_t), sizeof(video_ram));
-	SDL_RWwrite(f, &reg_composer[0], sizeof(uint8_t), sizeof(reg_composer));
+	SDL_RWwrite(f, &io_reg_composer[0], sizeof(uint8_t), sizeof(io_reg_composer));
 	SDL_RWwrite(f, &palette[0], sizeof(uint8_t), sizeof(palette));
-	SDL_RWwrite(f, &reg_layer[0][0], sizeof(uint8_t), sizeof(reg_layer));
+	SDL_RWwrite(f, &io_reg_layer[0][0], sizeof(uint8_t), sizeof(io_reg_layer));
 	SDL_RWwrite(f, &sprite_data[0], sizeof(uint8_t), sizeof(sprite_data));
 }
 
-bool
-video_update()
+// convert a pixel from the texture format to 0x00RRGGBB
+static uint32_t
+pixel_to_rgb888(uint32_t pixel)
 {
-	static bool cmd_down = false;
+	if (!texture_format) {
+		return pixel;
+	}
+	return
+		((pixel & texture_format->Rmask) >> texture_format->Rshift) << 16 |
+		((pixel & texture_format->Gmask) >> texture_format->Gshift) << 8 |
+		((pixel & texture_format->Bmask) >> texture_format->Bshift);
+}
 
-	bool mouse_changed = false;
+// convert the framebuffer from the texture format to 0x00RRGGBB pixels
+static void
+framebuffer_to_rgb888(uint32_t *dest)
+{
+	const uint32_t *src = (const uint32_t *)framebuffer;
+	if (!texture_format || texture_format->format == SDL_PIXELFORMAT_RGB888) {
+		memcpy(dest, src, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+		return;
+	}
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+		*dest++ = pixel_to_rgb888(*src++);
+	}
+}
 
-	// if LED is on, stamp red 8x4 square into top right of framebuffer
-	if (led_status) {
-		for (int y = 0; y < 4; y++) {
-			for (int x = SCREEN_WIDTH - 8; x < SCREEN_WIDTH; x++) {
-				framebuffer[(y * SCREEN_WIDTH + x) * 4 + 0] = 0x00;
-				framebuffer[(y * SCREEN_WIDTH + x) * 4 + 1] = 0x00;
-				framebuffer[(y * SCREEN_WIDTH + x) * 4 + 2] = 0xff;
-				framebuffer[(y * SCREEN_WIDTH + x) * 4 + 3] = 0x00;
+// GIF palette index of a color, adding it if there's still room
+static int
+gif_color_index(uint32_t color, GifPalette *pal, int *num_colors)
+{
+	const uint32_t key = color | 0x01000000; // 0 = empty
+	uint32_t h = (key * 2654435761u) >> (32 - GIF_COLOR_HASH_BITS);
+	while (gif_color_keys[h] && gif_color_keys[h] != key) {
+		h = (h + 1) & (GIF_COLOR_HASH_SIZE - 1);
+	}
+	if (!gif_color_keys[h]) {
+		if (*num_colors == 256) {
+			return -1;
+		}
+		gif_color_keys[h] = key;
+		gif_color_indices[h] = *num_colors;
+		// gif.h keeps the channels in BGR order
+		pal->r[*num_colors] = color;
+		pal->g[*num_colors] = color >> 8;
+		pal->b[*num_colors] = color >> 16;
+		(*num_colors)++;
+	}
+	return gif_color_indices[h];
+}
+
+// Write a frame of 0x00RRGGBB pixels to the GIF. VERA shows at most 256
+// palette colors, so the colors on screen usually fit into the GIF palette
+// as they are. Only if they don't (palette changes mid-frame, NTSC
+// overscan), gif.h quantizes the frame.
+static bool
+gif_encode_frame(const uint32_t *pixels, uint32_t delay)
+{
+	static GifPalette pal;
+
+	if (!gif_writer.f) {
+		return false;
+	}
+
+	const uint32_t *old_pixels = gif_writer.firstFrame ? NULL : gif_old_pixels;
+
+	// collect the colors of all changed pixels
+	memset(gif_color_keys, 0, sizeof(gif_color_keys));
+	int num_colors = 1; // 0 is the transparent color
+	uint32_t last_color = 0;
+	bool have_last = false;
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+		const uint32_t color = pixels[i];
+		if ((old_pixels && old_pixels[i] == color) || (have_last && color == last_color)) {
+			continue;
+		}
+		if (gif_color_index(color, &pal, &num_colors) < 0) {
+			memcpy(gif_old_pixels, pixels, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+			return GifWriteFrame(&gif_writer, (const uint8_t *)pixels, SCREEN_WIDTH, SCREEN_HEIGHT, delay, 8, false);
+		}
+		last_color = color;
+		have_last = true;
+	}
+
+	// unchanged pixels are transparent
+	uint8_t *out = gif_writer.oldImage;
+	int index = 0;
+	have_last = false;
+	for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++, out += 4) {
+		const uint32_t color = pixels[i];
+		out[0] = color;
+		out[1] = color >> 8;
+		out[2] = color >> 16;
+		if (old_pixels && old_pixels[i] == color) {
+			out[3] = kGifTransIndex;
+			continue;
+		}
+		if (!have_last || color != last_color) {
+			index = gif_color_index(color, &pal, &num_colors);
+			last_color = color;
+			have_last = true;
+		}
+		out[3] = index;
+	}
+	memcpy(gif_old_pixels, pixels, SCREEN_WIDTH * SCREEN_HEIGHT * 4);
+
+	gif_writer.firstFrame = false;
+	pal.bitDepth = 8;
+	GifWriteLzwImage(gif_writer.f, gif_writer.oldImage, 0, 0, SCREEN_WIDTH, SCREEN_HEIGHT, delay, &pal);
+	return true;
+}
+
+static int
+gif_thread_main(void *data)
+{
+	for (;;) {
+		SDL_SemWait(gif_queue_full_sem);
+		struct gif_queue_entry *entry = &gif_queue[gif_queue_rdidx];
+		gif_queue_rdidx = (gif_queue_rdidx + 1) % GIF_QUEUE_SIZE;
+		if (!entry->delay) {
+			return 0;
+		}
+		if (!gif_encode_frame(entry->pixels, entry->delay)) {
+			SDL_AtomicSet(&gif_failed, 1);
+		}
+		SDL_SemPost(gif_queue_free_sem);
+	}
+}
+
+// Queue the framebuffer for the GIF encoder. When the encoder falls
+// behind, either wait for it, or drop the frame and show the next one
+// for longer.
+static bool
+gif_queue_frame()
+{
+	static uint32_t dropped_delay;
+
+	if (!gif_thread) {
+		framebuffer_to_rgb888(gif_queue[0].pixels);
+		return gif_encode_frame(gif_queue[0].pixels, 2);
+	}
+	if (SDL_AtomicGet(&gif_failed)) {
+		return false;
+	}
+	if (gif_drop_frames) {
+		if (SDL_SemTryWait(gif_queue_free_sem)) {
+			dropped_delay += 2;
+			return true;
+		}
+	} else {
+		SDL_SemWait(gif_queue_free_sem);
+	}
+	struct gif_queue_entry *entry = &gif_queue[gif_queue_wridx];
+	gif_queue_wridx = (gif_queue_wridx + 1) % GIF_QUEUE_SIZE;
+	framebuffer_to_rgb888(entry->pixels);
+	entry->delay = 2 + dropped_delay;
+	dropped_delay = 0;
+	SDL_SemPost(gif_queue_full_sem);
+	return true;
+}
+
+// let the encoder finish all queued frames and stop it
+static void
+gif_stop_thread()
+{
+	if (!gif_thread) {
+		return;
+	}
+	SDL_SemWait(gif_queue_free_sem);
+	gif_queue[gif_queue_wridx].delay = 0;
+	SDL_SemPost(gif_queue_full_sem);
+	SDL_WaitThread(gif_thread, NULL);
+	gif_thread = NULL;
+	SDL_DestroySemaphore(gif_queue_free_sem);
+	SDL_DestroySemaphore(gif_queue_full_sem);
+}
+
+// Raw video capture for external encoders. Frames are written either as
+// YUV4MPEG2 (4:4:4, full range BT.601), or as color indices plus the
+// palette entries that changed since the previous frame.
+static bool
+video_capture_begin(const char *path)
+{
+	const size_t len = strlen(path);
+	capture_indexed = len >= 4 && !strcmp(path + len - 4, ".raw");
+
+	capture_file = strcmp(path, "-") ? fopen(path, "wb") : stdout;
+	if (!capture_file) {
+		fprintf(stderr, "Cannot open %s for video capture.\n", path);
+		return false;
+	}
+	setvbuf(capture_file, NULL, _IOFBF, 1 << 20);
+
+	// the VGA frame rate, 25.175 MHz / (800 * 525)
+	if (capture_indexed) {
+		fprintf(capture_file, "X16INDEXED W%d H%d F5035:84\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+		capture_indices = calloc(SCREEN_WIDTH * SCREEN_HEIGHT, 1);
+		// make the first frame contain the whole palette
+		memset(capture_palette, 0xff, sizeof(capture_palette));
+	} else {
+		fprintf(capture_file, "YUV4MPEG2 W%d H%d F5035:84 Ip A1:1 C444\n", SCREEN_WIDTH, SCREEN_HEIGHT);
+		capture_planes = malloc(SCREEN_WIDTH * SCREEN_HEIGHT * 3);
+	}
+	return true;
+}
+
+static void
+video_capture_frame()
+{
+	if (capture_indexed) {
+		// uint16 number of changed palette entries, {index, r, g, b} for
+		// each of them, then one color index per pixel
+		uint8_t changes[256 * 4];
+		int num_changes = 0;
+		for (int i = 0; i < 256; i++) {
+			const uint32_t color = pixel_to_rgb888(video_palette.entries[i]);
+			if (color != capture_palette[i]) {
+				capture_palette[i] = color;
+				changes[num_changes * 4 + 0] = i;
+				changes[num_changes * 4 + 1] = color >> 16;
+				changes[num_changes * 4 + 2] = color >> 8;
+				changes[num_changes * 4 + 3] = color;
+				num_changes++;
 			}
 		}
+		fputc(num_changes & 0xff, capture_file);
+		fputc(num_changes >> 8, capture_file);
+		fwrite(changes, 4, num_changes, capture_file);
+		fwrite(capture_indices, 1, SCREEN_WIDTH * SCREEN_HEIGHT, capture_file);
+	} else {
+		uint8_t *y_plane = capture_planes;
+		uint8_t *u_plane = y_plane + SCREEN_WIDTH * SCREEN_HEIGHT;
+		uint8_t *v_plane = u_plane + SCREEN_WIDTH * SCREEN_HEIGHT;
+		const uint32_t *src = (const uint32_t *)framebuffer;
+		uint32_t last_pixel = ~0u;
+		uint8_t y = 0, u = 0, v = 0;
+		for (int i = 0; i < SCREEN_WIDTH * SCREEN_HEIGHT; i++) {
+			// neighboring pixels are mostly the same color
+			if (src[i] != last_pixel) {
+				last_pixel = src[i];
+				const uint32_t color = pixel_to_rgb888(last_pixel);
+				const int r = color >> 16;
+				const int g = (color >> 8) & 0xff;
+				const int b = color & 0xff;
+				y = (77 * r + 150 * g + 29 * b) >> 8;
+				u = ((-43 * r - 85 * g + 128 * b) >> 8) + 128;
+				v = ((128 * r - 107 * g - 21 * b) >> 8) + 128;
+			}
+			y_plane[i] = y;
+			u_plane[i] = u;
+			v_plane[i] = v;
+		}
+		fputs("FRAME\n", capture_file);
+		fwrite(capture_planes, 1, SCREEN_WIDTH * SCREEN_HEIGHT * 3, capture_file);
 	}
+}
 
-	SDL_UpdateTexture(sdlTexture, NULL, framebuffer, SCREEN_WIDTH * 4);
+static void
+video_capture_end()
+{
+	if (capture_file != stdout) {
+		fclose(capture_file);
+	} else {
+		fflush(capture_file);
+	}
+	capture_file = NULL;
+	free(capture_indices);
+	capture_indices = NULL;
+	free(capture_planes);
+	capture_planes = NULL;
+}
 
-	if (record_gif > RECORD_GIF_PAUSED) {
-		if(!GifWriteFrame(&gif_writer, framebuffer, SCREEN_WIDTH, SCREEN_HEIGHT, 2, 8, false)) {
-			// if that failed, stop recording
-			GifEnd(&gif_writer);
-			record_gif = RECORD_GIF_DISABLED;
-			printf("Unexpected end of recording.\n");
+// upload the lines that changed since the texture was last updated
+static void
+upload_frame(const uint8_t *pixels, const uint32_t *frames, uint32_t serial, bool half)
+{
+	SDL_Texture *texture = half ? sdlTextureHalf : sdlTexture;
+	const int width = half ? HALF_WIDTH : SCREEN_WIDTH;
+	const int height = half ? HALF_HEIGHT : SCREEN_HEIGHT;
+	const int step = half ? 2 : 1;
+
+	if (texture != present_texture) {
+		// the other texture is out of date
+		present_texture = texture;
+		texture_frame = 0;
+	}
+
+	int y_min = height;
+	int y_max = -1;
+	for (int y = 0; y < height; y++) {
+		if (frames[y * step] > texture_frame) {
+			if (y < y_min) {
+				y_min = y;
+			}
+			y_max = y;
 		}
-		if (record_gif == RECORD_GIF_SINGLE) { // if single-shot stop recording
-			record_gif = RECORD_GIF_PAUSED;  // need to close in video_end()
+	}
+	if (y_min <= y_max) {
+		SDL_Rect rect = { 0, y_min, width, y_max - y_min + 1 };
+		SDL_UpdateTexture(texture, &rect, &pixels[y_min * width * 4], width * 4);
+	}
+	texture_frame = serial;
+}
+
+// hand the framebuffer to the presentation thread
+static void
+present_publish()
+{
+	struct video_frame *frame = &present_frames[present_back];
+	const int width = frame_half ? HALF_WIDTH : SCREEN_WIDTH;
+	const int height = frame_half ? HALF_HEIGHT : SCREEN_HEIGHT;
+	const int step = frame_half ? 2 : 1;
+
+	// this slot was last filled two or more frames ago
+	int y_min = height;
+	int y_max = -1;
+	for (int y = 0; y < height; y++) {
+		if (line_frame[y * step] > frame->serial) {
+			if (y < y_min) {
+				y_min = y;
+			}
+			y_max = y;
 		}
 	}
+	if (y_min <= y_max) {
+		memcpy(&frame->pixels[y_min * width * 4], &framebuffer[y_min * width * 4], (y_max - y_min + 1) * width * 4);
+	}
+	memcpy(frame->line_frame, line_frame, sizeof(line_frame));
+	frame->serial = present_serial;
+	frame->half = frame_half;
 
-	SDL_RenderClear(renderer);
-	SDL_RenderCopy(renderer, sdlTexture, NULL, NULL);
+	present_back = SDL_AtomicSet(&present_ready, present_back | PRESENT_FRESH) & 3;
+}
 
-	if (debugger_enabled && showDebugOnRender != 0) {
-		DEBUGRenderDisplay(SCREEN_WIDTH, SCREEN_HEIGHT);
-		SDL_RenderPresent(renderer);
-		return true;
+static void
+input_push(uint8_t type, SDL_Event *event, char *text)
+{
+	SDL_LockMutex(input_mutex);
+	if (input_queue_count < INPUT_QUEUE_SIZE) {
+		struct input_event *e = &input_queue[input_queue_count++];
+		e->type = type;
+		if (event) {
+			e->event = *event;
+		}
+		e->text = text;
 	}
+	SDL_UnlockMutex(input_mutex);
+}
 
-	SDL_RenderPresent(renderer);
+// Poll SDL events on the thread that owns the window. Shortcuts that need
+// the window are handled here, everything else goes to the emulation thread.
+static void
+poll_events()
+{
+	static bool cmd_down = false;
 
 	SDL_Event event;
 	while (SDL_PollEvent(&event)) {
-		if (event.type == SDL_QUIT) {
-			return false;
-		}
-		if (event.type == SDL_KEYDOWN) {
-			bool consumed = false;
-			if (cmd_down) {
-				if (event.key.keysym.sym == SDLK_s) {
-					machine_dump();
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_r) {
-					machine_reset();
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_v) {
-					machine_paste(SDL_GetClipboardText());
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_f || event.key.keysym.sym == SDLK_RETURN) {
-					is_fullscreen = !is_fullscreen;
-					SDL_SetWindowFullscreen(window, is_fullscreen ? SDL_WINDOW_FULLSCREEN : 0);
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_PLUS || event.key.keysym.sym == SDLK_EQUALS) {
-					machine_toggle_warp();
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_a) {
-					sdcard_attach();
-					consumed = true;
-				} else if (event.key.keysym.sym == SDLK_d) {
-					sdcard_detach();
-					consumed = true;
-				}
-			}
-			if (!consumed) {
-				if (event.key.keysym.scancode == LSHORTCUT_KEY || event.key.keysym.scancode == RSHORTCUT_KEY) {
-					cmd_down = true;
-				}
-				handle_keyboard(true, event.key.keysym.sym, event.key.keysym.scancode);
+		if (event.type == SDL_RENDER_TARGETS_RESET || event.type == SDL_RENDER_DEVICE_RESET) {
+			// texture contents may be lost, upload the whole frame again
+			texture_frame = 0;
+			continue;
+		}
+		if (event.type == SDL_KEYDOWN && cmd_down) {
+			if (event.key.keysym.sym == SDLK_s) {
+				input_push(INPUT_EVENT_DUMP, NULL, NULL);
+				continue;
+			} else if (event.key.keysym.sym == SDLK_r) {
+				input_push(INPUT_EVENT_RESET, NULL, NULL);
+				continue;
+			} else if (event.key.keysym.sym == SDLK_v) {
+				input_push(INPUT_EVENT_PASTE, NULL, SDL_GetClipboardText());
+				continue;
+			} else if (event.key.keysym.sym == SDLK_f || event.key.keysym.sym == SDLK_RETURN) {
+				is_fullscreen = !is_fullscreen;
+				SDL_SetWindowFullscreen(window, is_fullscreen ? SDL_WINDOW_FULLSCREEN : 0);
+				continue;
+			} else if (event.key.keysym.sym == SDLK_PLUS || event.key.keysym.sym == SDLK_EQUALS) {
+				input_push(INPUT_EVENT_TOGGLE_WARP, NULL, NULL);
+				continue;
+			} else if (event.key.keysym.sym == SDLK_a) {
+				input_push(INPUT_EVENT_SDCARD_ATTACH, NULL, NULL);
+				continue;
+			} else if (event.key.keysym.sym == SDLK_d) {
+				input_push(INPUT_EVENT_SDCARD_DETACH, NULL, NULL);
+				continue;
 			}
-			return true;
 		}
-		if (event.type == SDL_KEYUP) {
+		if (event.type == SDL_KEYDOWN || event.type == SDL_KEYUP) {
 			if (event.key.keysym.scancode == LSHORTCUT_KEY || event.key.keysym.scancode == RSHORTCUT_KEY) {
-				cmd_down = false;
+				cmd_down = event.type == SDL_KEYDOWN;
 			}
-			handle_keyboard(false, event.key.keysym.sym, event.key.keysym.scancode);
-			return true;
 		}
-		if (event.type == SDL_MOUSEBUTTONDOWN) {
-			switch (event.button.button) {
+		input_push(INPUT_EVENT_SDL, &event, NULL);
+	}
+}
+
+// Handle the queued input events on the emulation thread. Only one key
+// event is passed on per frame, later ones stay queued for the next frame.
+static bool
+handle_input()
+{
+	static struct input_event events[INPUT_QUEUE_SIZE];
+	static int mouse_x;
+	static int mouse_y;
+
+	SDL_LockMutex(input_mutex);
+	int count = input_queue_count;
+	memcpy(events, input_queue, count * sizeof(*events));
+	input_queue_count = 0;
+	SDL_UnlockMutex(input_mutex);
+
+	bool running = true;
+	bool key_handled = false;
+	bool mouse_changed = false;
+	int deferred = 0;
+
+	for (int i = 0; i < count; i++) {
+		struct input_event *e = &events[i];
+		switch (e->type) {
+			case INPUT_EVENT_DUMP:
+				machine_dump();
+				continue;
+			case INPUT_EVENT_RESET:
+				machine_reset();
+				continue;
+			case INPUT_EVENT_PASTE:
+				machine_paste(e->text);
+				continue;
+			case INPUT_EVENT_TOGGLE_WARP:
+				machine_toggle_warp();
+				continue;
+			case INPUT_EVENT_SDCARD_ATTACH:
+				sdcard_attach();
+				continue;
+			case INPUT_EVENT_SDCARD_DETACH:
+				sdcard_detach();
+				continue;
+		}
+
+		SDL_Event *event = &e->event;
+		if (event->type == SDL_QUIT) {
+			running = false;
+		}
+		if (event->type == SDL_KEYDOWN || event->type == SDL_KEYUP) {
+			if (key_handled) {
+				events[deferred++] = *e;
+				continue;
+			}
+			handle_keyboard(event->type == SDL_KEYDOWN, event->key.keysym.sym, event->key.keysym.scancode);
+			key_handled = true;
+		}
+		if (event->type == SDL_MOUSEBUTTONDOWN) {
+			switch (event->button.button) {
 				case SDL_BUTTON_LEFT:
 					mouse_button_down(0);
 					mouse_changed = true;
@@ -1158,8 +2155,8 @@ video_update()
 					break;
 			}
 		}
-		if (event.type == SDL_MOUSEBUTTONUP) {
-			switch (event.button.button) {
+		if (event->type == SDL_MOUSEBUTTONUP) {
+			switch (event->button.button) {
 				case SDL_BUTTON_LEFT:
 					mouse_button_up(0);
 					mouse_changed = true;
@@ -1170,33 +2167,190 @@ video_update()
 					break;
 			}
 		}
-		if (event.type == SDL_MOUSEMOTION) {
-			static int mouse_x;
-			static int mouse_y;
-			mouse_move(event.motion.x - mouse_x, event.motion.y - mouse_y);
-			mouse_x = event.motion.x;
-			mouse_y = event.motion.y;
+		if (event->type == SDL_MOUSEMOTION) {
+			mouse_move(event->motion.x - mouse_x, event->motion.y - mouse_y);
+			mouse_x = event->motion.x;
+			mouse_y = event->motion.y;
 			mouse_changed = true;
 		}
 	}
 	if (mouse_changed) {
 		mouse_send_state();
 	}
-	return true;
+
+	if (deferred) {
+		// put the deferred key events back in front of the newly queued ones
+		SDL_LockMutex(input_mutex);
+		int n = input_queue_count;
+		if (n > INPUT_QUEUE_SIZE - deferred) {
+			n = INPUT_QUEUE_SIZE - deferred;
+		}
+		memmove(&input_queue[deferred], input_queue, n * sizeof(*input_queue));
+		memcpy(input_queue, events, deferred * sizeof(*input_queue));
+		input_queue_count = n + deferred;
+		SDL_UnlockMutex(input_mutex);
+	}
+
+	return running;
+}
+
+static void
+present_frame()
+{
+	SDL_RenderClear(renderer);
+	SDL_RenderCopy(renderer, present_texture, NULL, NULL);
+	SDL_RenderPresent(renderer);
+}
+
+// Presentation thread main loop, returns after video_present_stop().
+void
+video_present_loop()
+{
+	while (!SDL_AtomicGet(&present_quit)) {
+		if (SDL_AtomicGet(&present_ready) & PRESENT_FRESH) {
+			present_front = SDL_AtomicSet(&present_ready, present_front) & 3;
+			const struct video_frame *frame = &present_frames[present_front];
+			upload_frame(frame->pixels, frame->line_frame, frame->serial, frame->half);
+			present_frame();
+		} else {
+			SDL_Delay(1);
+		}
+
+		poll_events();
+
+		SDL_LockMutex(input_mutex);
+		if (title_pending) {
+			SDL_SetWindowTitle(window, pending_title);
+			title_pending = false;
+		}
+		SDL_UnlockMutex(input_mutex);
+	}
+}
+
+void
+video_present_stop()
+{
+	SDL_AtomicSet(&present_quit, 1);
+}
+
+bool
+video_present_threaded()
+{
+	return present_threaded;
+}
+
+// Skip rendering the frame that just started, to catch up when the host
+// is too slow. Frames being recorded are always rendered, so recordings
+// follow emulated time.
+void
+video_skip_frame()
+{
+	if (record_gif > RECORD_GIF_PAUSED || capture_file) {
+		return;
+	}
+	skip_layers = true;
+}
+
+bool
+video_update()
+{
+	// wait for the frame to be completely rendered
+	video_sync_render();
+
+	// if LED is on, stamp red 8x4 square into top right of framebuffer
+	if (led_status) {
+		// re-render these lines next frame in case the LED turns off
+		memset(line_hash, 0, 4 * sizeof(line_hash[0]));
+		const uint32_t led_color = map_rgb(0xff, 0x00, 0x00);
+		const int width = frame_half ? HALF_WIDTH : SCREEN_WIDTH;
+		const int size = frame_half ? 2 : 4;
+		for (int y = 0; y < 4; y++) {
+			line_frame[y] = present_serial;
+		}
+		for (int y = 0; y < size; y++) {
+			for (int x = width - size * 2; x < width; x++) {
+				((uint32_t *)framebuffer)[y * width + x] = led_color;
+			}
+		}
+	}
+
+	if (record_gif > RECORD_GIF_PAUSED) {
+		if (!gif_queue_frame()) {
+			// if that failed, stop recording
+			gif_stop_thread();
+			GifEnd(&gif_writer);
+			record_gif = RECORD_GIF_DISABLED;
+			printf("Unexpected end of recording.\n");
+		}
+		if (record_gif == RECORD_GIF_SINGLE) { // if single-shot stop recording
+			record_gif = RECORD_GIF_PAUSED;  // need to close in video_end()
+		}
+	}
+
+	if (capture_file) {
+		video_capture_frame();
+	}
+
+	if (present_threaded) {
+		present_publish();
+		present_serial++;
+		return handle_input();
+	}
+
+	// only upload the lines that were rendered since the last frame
+	upload_frame(framebuffer, line_frame, present_serial, frame_half);
+	present_serial++;
+
+	if (debugger_enabled && showDebugOnRender != 0) {
+		SDL_RenderClear(renderer);
+		SDL_RenderCopy(renderer, present_texture, NULL, NULL);
+		DEBUGRenderDisplay(SCREEN_WIDTH, SCREEN_HEIGHT);
+		SDL_RenderPresent(renderer);
+		return true;
+	}
+
+	if (!last_frame_skipped) {
+		present_frame();
+	}
+
+	poll_events();
+	return handle_input();
 }
 
 void
 video_end()
 {
+	if (render_thread) {
+		render_command(RENDER_CMD_QUIT, 0, 0);
+		SDL_WaitThread(render_thread, NULL);
+		render_thread = NULL;
+		SDL_DestroySemaphore(render_queue_sem);
+		SDL_DestroySemaphore(render_sync_sem);
+		free(render_ram);
+		render_ram = video_ram;
+	}
+
 	if (debugger_enabled) {
 		DEBUGFreeUI();
 	}
 
 	if (record_gif != RECORD_GIF_DISABLED) {
+		gif_stop_thread();
 		GifEnd(&gif_writer);
 		record_gif = RECORD_GIF_DISABLED;
 	}
+	if (capture_file) {
+		video_capture_end();
+	}
+	free(gif_queue);
+	gif_queue = NULL;
+	free(gif_old_pixels);
+	gif_old_pixels = NULL;
 
+	SDL_FreeFormat(texture_format);
+	texture_format = NULL;
+
+	SDL_DestroyMutex(input_mutex);
 	SDL_DestroyRenderer(renderer);
 	SDL_DestroyWindow(window);
 }
@@ -1243,27 +2397,225 @@ static void
 video_space_read_range(uint8_t* dest, uint32_t address, uint32_t size)
 {
 	if (address >= ADDR_VRAM_START && (address+size) <= ADDR_VRAM_END) {
-		memcpy(dest, &video_ram[address], size);
+		memcpy(dest, &render_ram[address], size);
 	} else {
 		for(int i = 0; i < size; ++i) {
-			*dest++ = video_space_read(address + i);
+			*dest++ = render_space_read(address + i);
 		}
 	}
 }
 
-void
-video_space_write(uint32_t address, uint8_t value)
+// render-side part of a VRAM write
+static void
+render_space_write(uint32_t address, uint8_t value)
 {
-	video_ram[address & 0x1FFFF] = value;
+	if (render_ram[address & 0x1FFFF] != value) {
+		vram_write_gen++;
+		vram_block_gen[(address & 0x1FFFF) >> VRAM_BLOCK_SHIFT] = vram_write_gen;
+		vram_area_gen[(address & 0x1FFFF) >> VRAM_AREA_SHIFT]   = vram_write_gen;
+	}
+	render_ram[address & 0x1FFFF] = value;
 
-	if (address >= ADDR_PSG_START && address < ADDR_PSG_END) {
-		psg_writereg(address & 0x3f, value);
-	} else if (address >= ADDR_PALETTE_START && address < ADDR_PALETTE_END) {
+	if (address >= ADDR_PALETTE_START && address < ADDR_PALETTE_END) {
+		if (palette[address & 0x1ff] != value) {
+			palette_gen++;
+		}
 		palette[address & 0x1ff] = value;
-		video_palette.dirty = true;
+		mark_palette_dirty((address & 0x1ff) >> 1, ((address & 0x1ff) >> 1) + 1);
 	} else if (address >= ADDR_SPRDATA_START && address < ADDR_SPRDATA_END) {
 		sprite_data[(address >> 3) & 0x7f][address & 0x7] = value;
-		refresh_sprite_properties((address >> 3) & 0x7f);
+		mark_sprite_dirty((address >> 3) & 0x7f);
+	}
+}
+
+void
+video_space_write(uint32_t address, uint8_t value)
+{
+	// the data port address can run past 17 bits; it also has to fit
+	// into a render command
+	address &= 0x1FFFF;
+
+	if (render_ram != video_ram) {
+		video_ram[address] = value;
+	}
+
+	if (address >= ADDR_PSG_START && address < ADDR_PSG_END) {
+		audio_write_psg(address & 0x3f, value);
+	}
+
+	render_command(RENDER_CMD_VRAM_WRITE, address, value);
+}
+
+// copy a run of plain VRAM, only invalidating blocks whose contents change
+static void
+vram_write_run(uint32_t address, const uint8_t *src, uint32_t size)
+{
+	while (size > 0) {
+		uint32_t block_end = ((address >> VRAM_BLOCK_SHIFT) + 1) << VRAM_BLOCK_SHIFT;
+		uint32_t n = block_end - address;
+		if (n > size) {
+			n = size;
+		}
+		if (memcmp(&render_ram[address], src, n)) {
+			vram_write_gen++;
+			vram_block_gen[address >> VRAM_BLOCK_SHIFT] = vram_write_gen;
+			vram_area_gen[address >> VRAM_AREA_SHIFT]   = vram_write_gen;
+			memcpy(&render_ram[address], src, n);
+		}
+		if (render_ram != video_ram) {
+			memcpy(&video_ram[address], src, n);
+		}
+		address += n;
+		src += n;
+		size -= n;
+	}
+}
+
+// Write size bytes to the video address space, advancing the address by
+// stride after each byte like the data port does. Plain VRAM is copied in
+// bulk; PSG, palette and sprite bytes still go through their handlers.
+// Returns the address following the last byte written.
+uint32_t
+video_space_write_range(uint32_t address, int stride, const uint8_t *src, uint32_t size)
+{
+	// the render thread is idle after this, so its copy can be written directly
+	video_sync_render();
+
+	address &= 0x1FFFF;
+	while (size > 0) {
+		if (address < ADDR_PSG_START && stride == 1) {
+			uint32_t n = ADDR_PSG_START - address;
+			if (n > size) {
+				n = size;
+			}
+			vram_write_run(address, src, n);
+			src += n;
+			size -= n;
+			address += n;
+		} else {
+			if (address < ADDR_PSG_START) {
+				vram_write_run(address, src, 1);
+			} else {
+				if (render_ram != video_ram) {
+					video_ram[address] = *src;
+				}
+				if (address < ADDR_PSG_END) {
+					audio_write_psg(address & 0x3f, *src);
+				}
+				render_space_write(address, *src);
+			}
+			src++;
+			size--;
+			address += stride;
+		}
+		address &= 0x1FFFF;
+	}
+	return address;
+}
+
+//
+// Vera: Render thread
+//
+
+static void
+render_apply(uint8_t command, uint32_t address, uint8_t value)
+{
+	switch (command) {
+		case RENDER_CMD_VRAM_WRITE:
+			render_space_write(address, value);
+			break;
+		case RENDER_CMD_COMPOSER_WRITE:
+			reg_composer[address] = value;
+			if (address == 0) {
+				mark_palette_dirty(0, 256);
+			}
+			refresh_composer_properties();
+			break;
+		case RENDER_CMD_LAYER_WRITE:
+			reg_layer[address >> 3][address & 7] = value;
+			refresh_layer_properties(address >> 3);
+			break;
+		case RENDER_CMD_LINE:
+			render_line(address, value);
+			break;
+		case RENDER_CMD_CLEAR_COLLISIONS:
+			sprite_line_collisions = 0;
+			break;
+	}
+}
+
+static void
+render_queue_publish()
+{
+	SDL_AtomicSet(&render_queue_published_wridx, render_queue_wridx);
+	SDL_SemPost(render_queue_sem);
+}
+
+static void
+render_queue_push(uint32_t command)
+{
+	while (render_queue_wridx - render_queue_rdidx_cached >= RENDER_QUEUE_SIZE) {
+		render_queue_rdidx_cached = SDL_AtomicGet(&render_queue_rdidx);
+		if (render_queue_wridx - render_queue_rdidx_cached >= RENDER_QUEUE_SIZE) {
+			// full, wait for the render thread to catch up
+			render_queue_publish();
+			SDL_Delay(1);
+		}
+	}
+	render_queue[render_queue_wridx++ & (RENDER_QUEUE_SIZE - 1)] = command;
+}
+
+// Apply a render-side change right away, or queue it for the render thread.
+static void
+render_command(uint8_t command, uint32_t address, uint8_t value)
+{
+	if (!render_thread) {
+		render_apply(command, address, value);
+		return;
+	}
+	render_queue_push(command << 28 | address << 8 | value);
+	if (command == RENDER_CMD_LINE || command == RENDER_CMD_QUIT) {
+		render_queue_publish();
+	}
+}
+
+// Wait until the render thread has processed all queued commands.
+static void
+video_sync_render()
+{
+	if (!render_thread) {
+		return;
+	}
+	render_queue_push(RENDER_CMD_SYNC << 28);
+	render_queue_publish();
+	SDL_SemWait(render_sync_sem);
+}
+
+static int
+render_thread_main(void *data)
+{
+	uint32_t rdidx = 0;
+	for (;;) {
+		const uint32_t wridx = SDL_AtomicGet(&render_queue_published_wridx);
+		if (rdidx == wridx) {
+			SDL_SemWait(render_queue_sem);
+			continue;
+		}
+		while (rdidx != wridx) {
+			const uint32_t command = render_queue[rdidx++ & (RENDER_QUEUE_SIZE - 1)];
+			switch (command >> 28) {
+				case RENDER_CMD_SYNC:
+					SDL_AtomicSet(&render_queue_rdidx, rdidx);
+					SDL_SemPost(render_sync_sem);
+					break;
+				case RENDER_CMD_QUIT:
+					return 0;
+				default:
+					render_apply(command >> 28, (command >> 8) & 0xfffff, command & 0xff);
+					break;
+			}
+		}
+		SDL_AtomicSet(&render_queue_rdidx, rdidx);
 	}
 }
 
@@ -1295,13 +2647,13 @@ uint8_t video_read(uint8_t reg, bool debugOn) {
 		}
 		case 0x05: return (io_dcsel << 1) | io_addrsel;
 		case 0x06: return ((irq_line & 0x100) >> 1) | (ien & 0xF);
-		case 0x07: return isr | (pcm_is_fifo_almost_empty() ? 8 : 0);
+		case 0x07: audio_sync_pcm(); return isr | (pcm_is_fifo_almost_empty() ? 8 : 0);
 		case 0x08: return irq_line & 0xFF;
 
 		case 0x09:
 		case 0x0A:
 		case 0x0B:
-		case 0x0C: return reg_composer[reg - 0x09 + (io_dcsel ? 4 : 0)];
+		case 0x0C: return io_reg_composer[reg - 0x09 + (io_dcsel ? 4 : 0)];
 
 		case 0x0D:
 		case 0x0E:
@@ -1309,7 +2661,7 @@ uint8_t video_read(uint8_t reg, bool debugOn) {
 		case 0x10:
 		case 0x11:
 		case 0x12:
-		case 0x13: return reg_layer[0][reg - 0x0D];
+		case 0x13: return io_reg_layer[0][reg - 0x0D];
 
 		case 0x14:
 		case 0x15:
@@ -1317,9 +2669,9 @@ uint8_t video_read(uint8_t reg, bool debugOn) {
 		case 0x17:
 		case 0x18:
 		case 0x19:
-		case 0x1A: return reg_layer[1][reg - 0x14];
+		case 0x1A: return io_reg_layer[1][reg - 0x14];
 
-		case 0x1B: return pcm_read_ctrl();
+		case 0x1B: audio_sync_pcm(); return pcm_read_ctrl();
 		case 0x1C: return pcm_read_rate();
 		case 0x1D: return 0;
 
@@ -1382,10 +2734,8 @@ void video_write(uint8_t reg, uint8_t value) {
 		case 0x0B:
 		case 0x0C: {
 			int i = reg - 0x09 + (io_dcsel ? 4 : 0);
-			reg_composer[i] = value;
-			if (i == 0) {
-				video_palette.dirty = true;
-			}
+			io_reg_composer[i] = value;
+			render_command(RENDER_CMD_COMPOSER_WRITE, i, value);
 			break;
 		}
 
@@ -1396,8 +2746,8 @@ void video_write(uint8_t reg, uint8_t value) {
 		case 0x11:
 		case 0x12:
 		case 0x13:
-			reg_layer[0][reg - 0x0D] = value;
-			refresh_layer_properties(0);
+			io_reg_layer[0][reg - 0x0D] = value;
+			render_command(RENDER_CMD_LAYER_WRITE, 0 << 3 | (reg - 0x0D), value);
 			break;
 
 		case 0x14:
@@ -1407,13 +2757,13 @@ void video_write(uint8_t reg, uint8_t value) {
 		case 0x18:
 		case 0x19:
 		case 0x1A:
-			reg_layer[1][reg - 0x14] = value;
-			refresh_layer_properties(1);
+			io_reg_layer[1][reg - 0x14] = value;
+			render_command(RENDER_CMD_LAYER_WRITE, 1 << 3 | (reg - 0x14), value);
 			break;
 
-		case 0x1B: pcm_write_ctrl(value); break;
-		case 0x1C: pcm_write_rate(value); break;
-		case 0x1D: pcm_write_fifo(value); break;
+		case 0x1B: audio_sync_pcm(); pcm_write_ctrl(value); break;
+		case 0x1C: audio_sync_pcm(); pcm_write_rate(value); break;
+		case 0x1D: audio_sync_pcm(); pcm_write_fifo(value); break;
 
 		case 0x1E:
 		case 0x1F:
@@ -1425,7 +2775,15 @@ void video_write(uint8_t reg, uint8_t value) {
 void
 video_update_title(const char* window_title)
 {
-	SDL_SetWindowTitle(window, window_title);
+	if (!present_threaded) {
+		SDL_SetWindowTitle(window, window_title);
+		return;
+	}
+	// the presentation thread owns the window
+	SDL_LockMutex(input_mutex);
+	snprintf(pending_title, sizeof(pending_title), "%s", window_title);
+	title_pending = true;
+	SDL_UnlockMutex(input_mutex);
 }
 
 bool video_is_tilemap_address(int addr)
@@ -11,16 +11,22 @@
 #include <SDL.h>
 #include "glue.h"
 
-bool video_init(int window_scale, char *quality);
+bool video_init(int window_scale, char *quality, bool use_render_thread, bool use_present_thread);
 void video_reset(void);
-bool video_step(float mhz);
+bool video_step(uint8_t mhz, uint32_t clocks);
 bool video_update(void);
+void video_skip_frame(void);
 void video_end(void);
 bool video_get_irq_out(void);
+const uint8_t *video_get_framebuffer(void);
 void video_save(SDL_RWops *f);
 uint8_t video_read(uint8_t reg, bool debugOn);
 void video_write(uint8_t reg, uint8_t value);
+uint32_t video_space_write_range(uint32_t address, int stride, const uint8_t *src, uint32_t size);
 void video_update_title(const char* window_title);
+bool video_present_threaded(void);
+void video_present_loop(void);
+void video_present_stop(void);
 
 uint8_t via1_read(uint8_t reg);
 void via1_write(uint8_t reg, uint8_t value);